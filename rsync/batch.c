@@ -33,6 +33,7 @@ extern int preserve_devices;
 extern int preserve_uid;
 extern int preserve_gid;
 extern int always_checksum;
+extern int compact_flist;
 extern int do_compression;
 extern int def_compress_level;
 extern int protocol_version;
@@ -52,6 +53,7 @@ static int *flag_ptr[] = {
 	&always_checksum,	/* 6 */
 	&xfer_dirs,		/* 7 (protocol 29) */
 	&tweaked_compress_level,/* 8 (protocol 29) */
+	&compact_flist,		/* 9 (protocol 29) */
 	NULL
 };
 
@@ -65,6 +67,7 @@ static char *flag_name[] = {
 	"--checksum (-c)",
 	"--dirs (-d)",
 	"--compress (-z)",
+	"--compact-flist",
 	NULL
 };
 
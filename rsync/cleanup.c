@@ -141,10 +141,14 @@ NORETURN void _exit_cleanup(int code, const char *file, int line)
 				close(cleanup_fd_r);
 			if (cleanup_fd_w != -1) {
 				flush_write_file(cleanup_fd_w);
+				if (do_link_tmpfile(cleanup_fd_w, fname) < 0)
+					fname = NULL;
 				close(cleanup_fd_w);
 			}
-			finish_transfer(cleanup_new_fname, fname, NULL,
-					cleanup_file, 0, !partial_dir);
+			if (fname) {
+				finish_transfer(cleanup_new_fname, fname, NULL,
+						cleanup_file, 0, !partial_dir, 0);
+			}
 		}
 
 		/* FALLTHROUGH */
@@ -155,8 +159,9 @@ NORETURN void _exit_cleanup(int code, const char *file, int line)
 		/* FALLTHROUGH */
 #include "case_N.h"
 
-		if (cleanup_fname)
+		if (cleanup_fname && !tmpfile_is_unnamed(cleanup_fd_w))
 			do_unlink(cleanup_fname);
+		drop_finish_jobs();
 		if (code)
 			kill_all(SIGUSR1);
 		if (cleanup_pid && cleanup_pid == getpid()) {
@@ -104,8 +104,6 @@ int start_socket_client(char *host, char *path, int argc, char *argv[])
 	if (fd == -1)
 		exit_cleanup(RERR_SOCKETIO);
 
-	set_socket_options(fd, sockopts);
-
 	ret = start_inband_exchange(user, path, fd, fd, argc);
 
 	return ret ? ret : client_run(fd, fd, -1, argc, argv);
@@ -171,6 +169,7 @@ int start_inband_exchange(char *user, char *path, int f_in, int f_out,
 
 	p = strchr(path,'/');
 	if (p) *p = 0;
+	start_rtt_probe();
 	io_printf(f_out, "%s\n", path);
 	if (p) *p = '/';
 
@@ -184,6 +183,10 @@ int start_inband_exchange(char *user, char *path, int f_in, int f_out,
 			return -1;
 		}
 
+		/* Any MOTD lines were sent before our module request. */
+		if (strncmp(line, "@RSYNCD: ", 9) == 0)
+			finish_rtt_probe();
+
 		if (strncmp(line,"@RSYNCD: AUTHREQD ",18) == 0) {
 			auth_client(f_out, user, line+18);
 			continue;
@@ -488,6 +491,17 @@ static int rsync_module(int f_in, int f_out, int i, char *addr, char *host)
 	}
 #endif
 
+	/* This usually lives outside the module, so open it first. */
+	if (*lp_flist_snapshot(i)) {
+#ifdef SUPPORT_FLIST_SNAPSHOT
+		snapshot_open(lp_flist_snapshot(i));
+#else
+		rprintf(FLOG,
+			"\"flist snapshot\" is not supported on this system (module %s)\n",
+			name);
+#endif
+	}
+
 	if (use_chroot) {
 		/*
 		 * XXX: The 'use chroot' flag is a fairly reliable
@@ -582,6 +596,7 @@ static int rsync_module(int f_in, int f_out, int i, char *addr, char *host)
 		}
 	}
 
+	start_rtt_probe();
 	io_printf(f_out, "@RSYNCD: OK\n");
 
 	maxargs = MAX_ARGS;
@@ -593,6 +608,8 @@ static int rsync_module(int f_in, int f_out, int i, char *addr, char *host)
 		if (!read_line(f_in, line, sizeof line - 1))
 			return -1;
 
+		finish_rtt_probe();
+
 		if (!*line)
 			break;
 
@@ -714,6 +731,10 @@ static int rsync_module(int f_in, int f_out, int i, char *addr, char *host)
 			am_sender ? "outgo" : "incom", p);
 	}
 
+#ifdef SUPPORT_FLIST_SNAPSHOT
+	snapshot_start(lp_flist_snapshot_refresh(i), f_in, f_out);
+#endif
+
 	start_server(f_in, f_out, argc, argv);
 
 	return 0;
@@ -32,6 +32,7 @@ extern int read_batch;
 extern int checksum_seed;
 extern int basis_dir_cnt;
 extern int prune_empty_dirs;
+extern int compact_flist;
 extern int protocol_version;
 extern char *dest_option;
 
@@ -107,6 +108,14 @@ void setup_protocol(int f_out,int f_in)
 			    protocol_version);
 			exit_cleanup(RERR_PROTOCOL);
 		}
+
+		if (compact_flist) {
+			rprintf(FERROR,
+			    "--compact-flist requires protocol 29 or higher"
+			    " (negotiated %d).\n",
+			    protocol_version);
+			exit_cleanup(RERR_PROTOCOL);
+		}
 	}
 
 	if (am_server) {
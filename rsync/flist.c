@@ -32,12 +32,15 @@ extern int am_root;
 extern int am_server;
 extern int am_daemon;
 extern int am_sender;
+extern int am_generator;
 extern int do_progress;
 extern int always_checksum;
 extern int module_id;
 extern int ignore_errors;
 extern int numeric_ids;
+extern int compact_flist;
 extern int recurse;
+extern int inc_recurse;
 extern int xfer_dirs;
 extern int filesfrom_fd;
 extern int one_file_system;
@@ -57,6 +60,8 @@ extern int copy_unsafe_links;
 extern int protocol_version;
 extern int sanitize_paths;
 extern int munge_symlinks;
+extern int snapshot_active;
+extern char *flist_spill_dir;
 extern struct stats stats;
 extern struct file_list *the_file_list;
 
@@ -73,11 +78,18 @@ int io_error;
 int checksum_len;
 dev_t filesystem_dev; /* used to implement -x */
 unsigned int file_struct_len;
+double flist_recv_rate; /* bytes/sec that the received file list arrived at */
 
 static char empty_sum[MD4_SUM_LENGTH];
 static int flist_count_offset;
+static int in_sub_list;
+
+/* Memory-use statistics for show_flist_stats(). */
+static int64 flist_entries, flist_entry_bytes;
+static int64 flist_dirnames, dirname_bytes_saved;
 
 static void clean_flist(struct file_list *flist, int strip_root, int no_dups);
+static void sort_file_list(struct file_struct **files, int count);
 static void output_flist(struct file_list *flist);
 
 void init_flist(void)
@@ -109,6 +121,9 @@ static void emit_filelist_progress(int count)
 
 static void maybe_emit_filelist_progress(int count)
 {
+	/* A sub-list arrives in the middle of the transfer's output. */
+	if (in_sub_list)
+		return;
 	if (do_progress && show_filelist_p() && (count % 100) == 0)
 		emit_filelist_progress(count);
 }
@@ -125,7 +140,82 @@ static void finish_filelist_progress(const struct file_list *flist)
 
 void show_flist_stats(void)
 {
-	/* Nothing yet */
+	if (!flist_entries)
+		return;
+
+	rprintf(FINFO, RSYNC_NAME "[%d] (%s) file-list statistics:\n",
+		getpid(), who_am_i());
+	rprintf(FINFO, "  entries:   %10.0f   (%d bytes of file_struct each)\n",
+		(double)flist_entries, file_struct_len);
+	rprintf(FINFO, "  bytes:     %10.0f   (%.1f per entry, with names)\n",
+		(double)flist_entry_bytes,
+		(double)flist_entry_bytes / flist_entries);
+	rprintf(FINFO, "  dirnames:  %10.0f   (%.0f bytes saved by sharing)\n",
+		(double)flist_dirnames, (double)dirname_bytes_saved);
+}
+
+static uint32 dirname_hash(const char *dir, int len)
+{
+	uint32 h = 5381;
+
+	while (len--)
+		h = h * 33 + *(uchar *)dir++;
+	return h;
+}
+
+/* Directory names are interned per file list, so that all the entries in a
+ * directory share one copy of its name even when they don't arrive together
+ * (e.g. with --files-from, or --relative and several args).  This returns
+ * the table slot for the name, which is empty (name is NULL) if the caller
+ * needs to add it. */
+static struct dirname_entry *intern_dirname(struct file_list *flist,
+					    const char *dir, int len)
+{
+	struct dirname_entry *de;
+	int i;
+
+	if (flist->dirnames_cnt * 2 >= flist->dirnames_size) {
+		struct dirname_entry *old = flist->dirnames;
+		int old_size = flist->dirnames_size;
+
+		flist->dirnames_size = old_size ? old_size * 2 : 1024;
+		flist->dirnames = new_array(struct dirname_entry,
+					    flist->dirnames_size);
+		if (!flist->dirnames)
+			out_of_memory("intern_dirname");
+		memset(flist->dirnames, 0,
+		       flist->dirnames_size * sizeof flist->dirnames[0]);
+		for (i = 0; i < old_size; i++) {
+			uint32 h;
+			if (!old[i].name)
+				continue;
+			h = dirname_hash(old[i].name, old[i].len);
+			while (flist->dirnames[h & (flist->dirnames_size-1)].name)
+				h++;
+			flist->dirnames[h & (flist->dirnames_size-1)] = old[i];
+		}
+		if (old)
+			free(old);
+	}
+
+	i = dirname_hash(dir, len) & (flist->dirnames_size - 1);
+	while (1) {
+		de = &flist->dirnames[i];
+		if (!de->name || (de->len == len
+		    && memcmp(de->name, dir, len) == 0))
+			return de;
+		i = (i + 1) & (flist->dirnames_size - 1);
+	}
+}
+
+static void add_dirname(struct file_list *flist, struct dirname_entry *de,
+			char *name, int len, int depth)
+{
+	de->name = name;
+	de->len = len;
+	de->depth = depth;
+	flist->dirnames_cnt++;
+	flist_dirnames++;
 }
 
 static void list_file_entry(struct file_struct *f)
@@ -155,6 +245,93 @@ static void list_file_entry(struct file_struct *f)
 	}
 }
 
+#if defined HAVE_DIRFD && defined HAVE_FSTATAT && defined HAVE_READLINKAT
+#define USE_DIRFD_WALK 1
+#endif
+
+#ifdef USE_DIRFD_WALK
+/* While send_directory() stats the entries of a directory, it leaves the
+ * directory open here so that we can use fstatat() and readlinkat() on
+ * each entry's name instead of having the kernel look up every component
+ * of its full path again. */
+static int walk_dirfd = -1;
+static const char *walk_dir;
+static int walk_dir_len;
+
+/* Returns the name of path relative to walk_dirfd, or NULL. */
+static const char *walk_name(const char *path)
+{
+	const char *name;
+
+	if (walk_dirfd < 0)
+		return NULL;
+	if (walk_dir_len == 2 && walk_dir[0] == '.')
+		name = path; /* clean_fname() removed the "./" */
+	else if (strncmp(path, walk_dir, walk_dir_len) == 0)
+		name = path + walk_dir_len;
+	else
+		return NULL;
+
+	return *name && !strchr(name, '/') ? name : NULL;
+}
+#endif
+
+static int walk_stat(const char *path, STRUCT_STAT *stp)
+{
+#ifdef USE_DIRFD_WALK
+	const char *name;
+#endif
+#ifdef SUPPORT_FLIST_SNAPSHOT
+	int ret;
+	if (snapshot_active
+	 && (ret = snapshot_stat(path, stp, 1)) != SNAPSHOT_MISS)
+		return ret;
+#endif
+#ifdef USE_DIRFD_WALK
+	if ((name = walk_name(path)) != NULL)
+		return do_stat_at(walk_dirfd, name, stp);
+#endif
+	return do_stat(path, stp);
+}
+
+#ifdef SUPPORT_LINKS
+static int walk_lstat(const char *path, STRUCT_STAT *stp)
+{
+#ifdef USE_DIRFD_WALK
+	const char *name;
+#endif
+#ifdef SUPPORT_FLIST_SNAPSHOT
+	int ret;
+	if (snapshot_active
+	 && (ret = snapshot_stat(path, stp, 0)) != SNAPSHOT_MISS)
+		return ret;
+#endif
+#ifdef USE_DIRFD_WALK
+	if ((name = walk_name(path)) != NULL)
+		return do_lstat_at(walk_dirfd, name, stp);
+#endif
+	return do_lstat(path, stp);
+}
+
+static int walk_readlink(const char *path, char *buf, size_t bufsiz)
+{
+#ifdef USE_DIRFD_WALK
+	const char *name;
+#endif
+#ifdef SUPPORT_FLIST_SNAPSHOT
+	int ret;
+	if (snapshot_active
+	 && (ret = snapshot_readlink(path, buf, bufsiz)) != SNAPSHOT_MISS)
+		return ret;
+#endif
+#ifdef USE_DIRFD_WALK
+	if ((name = walk_name(path)) != NULL)
+		return readlinkat(walk_dirfd, name, buf, bufsiz);
+#endif
+	return readlink(path, buf, bufsiz);
+}
+#endif
+
 /* Stat either a symlink or its referent, depending on the settings of
  * copy_links, copy_unsafe_links, etc.  Returns -1 on error, 0 on success.
  *
@@ -169,7 +346,7 @@ static int readlink_stat(const char *path, STRUCT_STAT *stp, char *linkbuf)
 	if (link_stat(path, stp, copy_dirlinks) < 0)
 		return -1;
 	if (S_ISLNK(stp->st_mode)) {
-		int llen = readlink(path, linkbuf, MAXPATHLEN - 1);
+		int llen = walk_readlink(path, linkbuf, MAXPATHLEN - 1);
 		if (llen < 0)
 			return -1;
 		linkbuf[llen] = '\0';
@@ -178,7 +355,7 @@ static int readlink_stat(const char *path, STRUCT_STAT *stp, char *linkbuf)
 				rprintf(FINFO,"copying unsafe symlink \"%s\" -> \"%s\"\n",
 					path, linkbuf);
 			}
-			return do_stat(path, stp);
+			return walk_stat(path, stp);
 		}
 		if (munge_symlinks && am_sender && llen > SYMLINK_PREFIX_LEN
 		 && strncmp(linkbuf, SYMLINK_PREFIX, SYMLINK_PREFIX_LEN) == 0) {
@@ -188,7 +365,7 @@ static int readlink_stat(const char *path, STRUCT_STAT *stp, char *linkbuf)
 	}
 	return 0;
 #else
-	return do_stat(path, stp);
+	return walk_stat(path, stp);
 #endif
 }
 
@@ -196,24 +373,24 @@ int link_stat(const char *path, STRUCT_STAT *stp, int follow_dirlinks)
 {
 #ifdef SUPPORT_LINKS
 	if (copy_links)
-		return do_stat(path, stp);
-	if (do_lstat(path, stp) < 0)
+		return walk_stat(path, stp);
+	if (walk_lstat(path, stp) < 0)
 		return -1;
 	if (follow_dirlinks && S_ISLNK(stp->st_mode)) {
 		STRUCT_STAT st;
-		if (do_stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+		if (walk_stat(path, &st) == 0 && S_ISDIR(st.st_mode))
 			*stp = st;
 	}
 	return 0;
 #else
-	return do_stat(path, stp);
+	return walk_stat(path, stp);
 #endif
 }
 
 /* This function is used to check if a file should be included/excluded
  * from the list of files based on its name and type etc.  The value of
  * filter_level is set to either SERVER_FILTERS or ALL_FILTERS. */
-static int is_excluded(char *fname, int is_dir, int filter_level)
+int is_excluded(char *fname, int is_dir, int filter_level)
 {
 #if 0 /* This currently never happens, so avoid a useless compare. */
 	if (filter_level == NO_FILTERS)
@@ -267,6 +444,198 @@ static void send_directory(int f, struct file_list *flist,
 static char *flist_dir;
 static int flist_dir_len;
 
+#ifdef SUPPORT_FLIST_SPILL
+/* With --flist-spill-dir, the entries of the main file list (its file_pool
+ * extents) and its files[] array are kept in unlinked temp files that are
+ * mapped into memory.  The kernel can then write those pages out to the
+ * files and drop them when memory is short, so a list that is bigger than
+ * RAM doesn't need to fit in swap.  The maps are shared, which is what puts
+ * the data into the files.  Once the receiving side has the whole list
+ * (and before the generator and receiver share it across a fork) each map
+ * is replaced by a private one of the same data, so a later change to an
+ * entry stays in the process that made it, just as with malloced memory.
+ * Only the pages that a process changes after that use up memory. */
+#define SPILL_CHUNK (64 * 1024 * 1024)
+
+static struct file_list *spill_flist;
+static int spill_fd = -1, spill_array_fd = -1;
+static char **spill_chunks;
+static int spill_chunk_cnt;
+static size_t spill_chunk_used;
+static size_t spill_array_len;
+static int spill_map_flags = MAP_SHARED;
+
+static int spill_open(void)
+{
+	char fname[MAXPATHLEN];
+	int fd;
+
+	if (pathjoin(fname, sizeof fname, flist_spill_dir, ".rsync-flist.XXXXXX")
+	    >= sizeof fname) {
+		rprintf(FERROR, "--flist-spill-dir path is too long [%s]\n",
+			who_am_i());
+		exit_cleanup(RERR_SYNTAX);
+	}
+	if ((fd = mkstemp(fname)) < 0) {
+		rsyserr(FERROR, errno, "unable to create a file in %s [%s]",
+			full_fname(flist_spill_dir), who_am_i());
+		exit_cleanup(RERR_FILEIO);
+	}
+	unlink(fname);
+	return fd;
+}
+
+/* Extend fd by len bytes at offset, reserving the disk space where we can
+ * so that a full disk can't turn a write to the mapped bytes into SIGBUS. */
+static void spill_extend(int fd, OFF_T offset, OFF_T len)
+{
+#ifdef HAVE_POSIX_FALLOCATE
+	int err = posix_fallocate(fd, offset, len);
+	if (err == 0)
+		return;
+	if (err != EINVAL && err != EOPNOTSUPP) {
+		rsyserr(FERROR, err, "unable to extend a --flist-spill-dir file [%s]",
+			who_am_i());
+		exit_cleanup(RERR_FILEIO);
+	}
+#endif
+	if (ftruncate(fd, offset + len) < 0) {
+		rsyserr(FERROR, errno, "unable to extend a --flist-spill-dir file [%s]",
+			who_am_i());
+		exit_cleanup(RERR_FILEIO);
+	}
+}
+
+static void *spill_map(void *addr, size_t len, int fd, OFF_T offset)
+{
+	int flags = addr ? spill_map_flags | MAP_FIXED : spill_map_flags;
+
+	addr = mmap(addr, len, PROT_READ | PROT_WRITE, flags, fd, offset);
+	if (addr == MAP_FAILED) {
+		rsyserr(FERROR, errno, "unable to map a --flist-spill-dir file [%s]",
+			who_am_i());
+		exit_cleanup(RERR_FILEIO);
+	}
+	return addr;
+}
+
+/* The file_pool's extents are carved out of SPILL_CHUNK-sized maps, so that
+ * a huge list doesn't need a map per extent. */
+static void *spill_extent_alloc(size_t len)
+{
+	char *addr;
+
+	len = (len + 63) & ~(size_t)63;
+	if (!spill_chunk_cnt || spill_chunk_used + len > SPILL_CHUNK) {
+		OFF_T offset = (OFF_T)spill_chunk_cnt * SPILL_CHUNK;
+		if (len > SPILL_CHUNK)
+			return NULL;
+		if (!(spill_chunk_cnt % 64)) {
+			spill_chunks = realloc_array(spill_chunks, char *,
+						     spill_chunk_cnt + 64);
+			if (!spill_chunks)
+				out_of_memory("spill_extent_alloc");
+		}
+		spill_extend(spill_fd, offset, SPILL_CHUNK);
+		spill_chunks[spill_chunk_cnt++] =
+			spill_map(NULL, SPILL_CHUNK, spill_fd, offset);
+		spill_chunk_used = 0;
+	}
+	addr = spill_chunks[spill_chunk_cnt - 1] + spill_chunk_used;
+	spill_chunk_used += len;
+
+	return addr;
+}
+
+/* An extent's space is only given back when the whole list is freed. */
+static void spill_extent_free(UNUSED(void *addr), UNUSED(size_t len))
+{
+}
+
+static struct file_struct **spill_expand(struct file_struct **files,
+					 int count)
+{
+	struct file_struct **new_files;
+	size_t len = count * sizeof files[0];
+
+	if (spill_map_flags != MAP_SHARED) {
+		/* The list is done, so just move the array to the heap. */
+		if (!(new_files = new_array(struct file_struct *, count)))
+			return NULL;
+		memcpy(new_files, files, spill_array_len);
+		munmap((void *)files, spill_array_len);
+		spill_array_len = 0;
+		return new_files;
+	}
+
+	/* The old entries are already in the file, so we map the whole
+	 * array again rather than copying it. */
+	spill_extend(spill_array_fd, spill_array_len, len - spill_array_len);
+	if (files)
+		munmap((void *)files, spill_array_len);
+	new_files = spill_map(NULL, len, spill_array_fd, 0);
+	spill_array_len = len;
+
+	return new_files;
+}
+
+/* Keep flist's entries and files[] array in --flist-spill-dir. */
+static void flist_spill_start(struct file_list *flist)
+{
+	spill_fd = spill_open();
+	spill_array_fd = spill_open();
+	pool_set_extents(flist->file_pool, spill_extent_alloc, spill_extent_free);
+	spill_flist = flist;
+
+	if (verbose > 2) {
+		rprintf(FINFO, "[%s] keeping the file list in %s\n",
+			who_am_i(), flist_spill_dir);
+	}
+}
+
+/* The list is complete, so switch each map to a private one. */
+static void flist_spill_done(struct file_list *flist)
+{
+	int j;
+
+	if (flist != spill_flist || spill_map_flags != MAP_SHARED)
+		return;
+
+	spill_map_flags = MAP_PRIVATE;
+	for (j = 0; j < spill_chunk_cnt; j++) {
+		spill_map(spill_chunks[j], SPILL_CHUNK, spill_fd,
+			  (OFF_T)j * SPILL_CHUNK);
+	}
+	if (spill_array_len) {
+		spill_map((void *)flist->files, spill_array_len,
+			  spill_array_fd, 0);
+	}
+}
+
+static void flist_spill_free(struct file_list *flist)
+{
+	int j;
+
+	for (j = 0; j < spill_chunk_cnt; j++)
+		munmap(spill_chunks[j], SPILL_CHUNK);
+	if (spill_chunks)
+		free(spill_chunks);
+	spill_chunks = NULL;
+	spill_chunk_cnt = 0;
+	if (spill_array_len)
+		munmap((void *)flist->files, spill_array_len);
+	else if (flist->files)
+		free(flist->files);
+	flist->files = NULL;
+	spill_array_len = 0;
+	close(spill_fd);
+	close(spill_array_fd);
+	spill_fd = spill_array_fd = -1;
+	spill_map_flags = MAP_SHARED;
+	spill_flist = NULL;
+}
+#endif
+
 
 /**
  * Make sure @p flist is big enough to hold at least @p flist->count
@@ -293,6 +662,11 @@ void flist_expand(struct file_list *flist)
 	if (flist->malloced < flist->count)
 		flist->malloced = flist->count;
 
+#ifdef SUPPORT_FLIST_SPILL
+	if (flist == spill_flist && (flist->files == NULL || spill_array_len))
+		new_ptr = spill_expand(flist->files, flist->malloced);
+	else
+#endif
 	new_ptr = realloc_array(flist->files, struct file_struct *,
 				flist->malloced);
 
@@ -309,6 +683,20 @@ void flist_expand(struct file_list *flist)
 		out_of_memory("flist_expand");
 }
 
+/* With --compact-flist, mtimes are sent as the difference from the previous
+ * entry's mtime.  This maps a signed difference onto a non-negative number
+ * (0, -1, 1, -2, ... become 0, 1, 2, 3, ...) so that write_varlong() can
+ * send a small difference in either direction in a byte or two. */
+static int64 zigzag(int64 d)
+{
+	return d < 0 ? ((-(d + 1)) << 1) | 1 : d << 1;
+}
+
+static int64 unzigzag(int64 v)
+{
+	return v & 1 ? -(v >> 1) - 1 : v >> 1;
+}
+
 static void send_file_entry(struct file_struct *file, int f)
 {
 	unsigned short flags;
@@ -321,6 +709,7 @@ static void send_file_entry(struct file_struct *file, int f)
 	static gid_t gid;
 	static char lastname[MAXPATHLEN];
 	char fname[MAXPATHLEN];
+	int64 time_delta = 0;
 	int l1, l2;
 
 	if (f < 0)
@@ -372,8 +761,10 @@ static void send_file_entry(struct file_struct *file, int f)
 		gid = file->gid;
 	if (file->modtime == modtime)
 		flags |= XMIT_SAME_TIME;
-	else
+	else {
+		time_delta = file->modtime - modtime;
 		modtime = file->modtime;
+	}
 
 #ifdef SUPPORT_HARD_LINKS
 	if (file->link_u.idev) {
@@ -422,20 +813,34 @@ static void send_file_entry(struct file_struct *file, int f)
 		write_byte(f, l2);
 	write_buf(f, fname + l1, l2);
 
-	write_longint(f, file->length);
-	if (!(flags & XMIT_SAME_TIME))
-		write_int(f, modtime);
-	if (!(flags & XMIT_SAME_MODE))
-		write_int(f, to_wire_mode(mode));
+	if (compact_flist) {
+		write_varlong(f, file->length);
+		if (!(flags & XMIT_SAME_TIME))
+			write_varlong(f, zigzag(time_delta));
+		if (!(flags & XMIT_SAME_MODE))
+			write_varint(f, to_wire_mode(mode));
+	} else {
+		write_longint(f, file->length);
+		if (!(flags & XMIT_SAME_TIME))
+			write_int(f, modtime);
+		if (!(flags & XMIT_SAME_MODE))
+			write_int(f, to_wire_mode(mode));
+	}
 	if (preserve_uid && !(flags & XMIT_SAME_UID)) {
 		if (!numeric_ids)
 			add_uid(uid);
-		write_int(f, uid);
+		if (compact_flist)
+			write_varint(f, uid);
+		else
+			write_int(f, uid);
 	}
 	if (preserve_gid && !(flags & XMIT_SAME_GID)) {
 		if (!numeric_ids)
 			add_gid(gid);
-		write_int(f, gid);
+		if (compact_flist)
+			write_varint(f, gid);
+		else
+			write_int(f, gid);
 	}
 	if ((preserve_devices && IS_DEVICE(mode))
 	 || (preserve_specials && IS_SPECIAL(mode))) {
@@ -455,7 +860,10 @@ static void send_file_entry(struct file_struct *file, int f)
 #ifdef SUPPORT_LINKS
 	if (preserve_links && S_ISLNK(mode)) {
 		int len = strlen(file->u.link);
-		write_int(f, len);
+		if (compact_flist)
+			write_varint(f, len);
+		else
+			write_int(f, len);
 		write_buf(f, file->u.link, len);
 	}
 #endif
@@ -468,9 +876,15 @@ static void send_file_entry(struct file_struct *file, int f)
 			write_int(f, file->F_INODE);
 		} else {
 			/* 64-bit dev_t and ino_t */
-			if (!(flags & XMIT_SAME_DEV))
-				write_longint(f, dev);
-			write_longint(f, file->F_INODE);
+			if (compact_flist) {
+				if (!(flags & XMIT_SAME_DEV))
+					write_varlong(f, dev);
+				write_varlong(f, file->F_INODE);
+			} else {
+				if (!(flags & XMIT_SAME_DEV))
+					write_longint(f, dev);
+				write_longint(f, file->F_INODE);
+			}
 		}
 	}
 #endif
@@ -508,6 +922,7 @@ static struct file_struct *receive_file_entry(struct file_list *flist,
 	int alloc_len, basename_len, dirname_len, linkname_len, sum_len;
 	OFF_T file_length;
 	char *basename, *dirname, *bp;
+	struct dirname_entry *de = NULL;
 	struct file_struct *file;
 
 	if (!flist) {
@@ -553,6 +968,13 @@ static struct file_struct *receive_file_entry(struct file_list *flist,
 		    && strncmp(thisname, lastdir, lastdir_len) == 0) {
 			dirname = lastdir;
 			dirname_len = 0; /* indicates no copy is needed */
+		} else if ((de = intern_dirname(flist, thisname,
+						dirname_len - 1))->name) {
+			dirname = lastdir = de->name;
+			lastdir_len = de->len;
+			lastdir_depth = de->depth;
+			dirname_bytes_saved += dirname_len;
+			dirname_len = 0;
 		} else
 			dirname = thisname;
 	} else {
@@ -562,19 +984,27 @@ static struct file_struct *receive_file_entry(struct file_list *flist,
 	}
 	basename_len = strlen(basename) + 1; /* count the '\0' */
 
-	file_length = read_longint(f);
-	if (!(flags & XMIT_SAME_TIME))
-		modtime = (time_t)read_int(f);
-	if (!(flags & XMIT_SAME_MODE))
-		mode = from_wire_mode(read_int(f));
+	if (compact_flist) {
+		file_length = read_varlong(f);
+		if (!(flags & XMIT_SAME_TIME))
+			modtime += (time_t)unzigzag(read_varlong(f));
+		if (!(flags & XMIT_SAME_MODE))
+			mode = from_wire_mode(read_varint(f));
+	} else {
+		file_length = read_longint(f);
+		if (!(flags & XMIT_SAME_TIME))
+			modtime = (time_t)read_int(f);
+		if (!(flags & XMIT_SAME_MODE))
+			mode = from_wire_mode(read_int(f));
+	}
 
 	if (chmod_modes && !S_ISLNK(mode))
 		mode = tweak_mode(mode, chmod_modes);
 
 	if (preserve_uid && !(flags & XMIT_SAME_UID))
-		uid = (uid_t)read_int(f);
+		uid = (uid_t)(compact_flist ? read_varint(f) : read_int(f));
 	if (preserve_gid && !(flags & XMIT_SAME_GID))
-		gid = (gid_t)read_int(f);
+		gid = (gid_t)(compact_flist ? read_varint(f) : read_int(f));
 
 	if ((preserve_devices && IS_DEVICE(mode))
 	 || (preserve_specials && IS_SPECIAL(mode))) {
@@ -596,7 +1026,8 @@ static struct file_struct *receive_file_entry(struct file_list *flist,
 
 #ifdef SUPPORT_LINKS
 	if (preserve_links && S_ISLNK(mode)) {
-		linkname_len = read_int(f) + 1; /* count the '\0' */
+		linkname_len = (compact_flist ? read_varint(f) : read_int(f))
+			     + 1; /* count the '\0' */
 		if (linkname_len <= 0 || linkname_len > MAXPATHLEN) {
 			rprintf(FERROR, "overflow: linkname_len=%d\n",
 				linkname_len - 1);
@@ -614,6 +1045,8 @@ static struct file_struct *receive_file_entry(struct file_list *flist,
 	alloc_len = file_struct_len + dirname_len + basename_len
 		  + linkname_len + sum_len;
 	bp = pool_alloc(flist->file_pool, alloc_len, "receive_file_entry");
+	flist_entries++;
+	flist_entry_bytes += alloc_len;
 
 	file = (struct file_struct *)bp;
 	memset(bp, 0, file_struct_len);
@@ -633,6 +1066,7 @@ static struct file_struct *receive_file_entry(struct file_list *flist,
 		bp[-1] = '\0';
 		lastdir_depth = count_dir_elements(lastdir);
 		file->dir.depth = lastdir_depth + 1;
+		add_dirname(flist, de, lastdir, lastdir_len, lastdir_depth);
 	} else if (dirname) {
 		file->dirname = dirname; /* we're reusing lastname */
 		file->dir.depth = lastdir_depth + 1;
@@ -694,9 +1128,15 @@ static struct file_struct *receive_file_entry(struct file_list *flist,
 			dev = read_int(f);
 			inode = read_int(f);
 		} else {
-			if (!(flags & XMIT_SAME_DEV))
-				dev = read_longint(f);
-			inode = read_longint(f);
+			if (compact_flist) {
+				if (!(flags & XMIT_SAME_DEV))
+					dev = read_varlong(f);
+				inode = read_varlong(f);
+			} else {
+				if (!(flags & XMIT_SAME_DEV))
+					dev = read_longint(f);
+				inode = read_longint(f);
+			}
 		}
 		if (flist->hlink_pool) {
 			file->link_u.idev = pool_talloc(flist->hlink_pool,
@@ -750,6 +1190,7 @@ struct file_struct *make_file(char *fname, struct file_list *flist,
 	char linkname[MAXPATHLEN];
 	int alloc_len, basename_len, dirname_len, linkname_len, sum_len;
 	char *basename, *dirname, *bp;
+	struct dirname_entry *de = NULL;
 
 	if (!flist || !flist->count)	/* Ignore lastdir when invalid. */
 		lastdir_len = -1;
@@ -847,6 +1288,12 @@ struct file_struct *make_file(char *fname, struct file_list *flist,
 		    && strncmp(thisname, lastdir, lastdir_len) == 0) {
 			dirname = lastdir;
 			dirname_len = 0; /* indicates no copy is needed */
+		} else if (flist && (de = intern_dirname(flist, thisname,
+						dirname_len - 1))->name) {
+			dirname = lastdir = de->name;
+			lastdir_len = de->len;
+			dirname_bytes_saved += dirname_len;
+			dirname_len = 0;
 		} else
 			dirname = thisname;
 	} else {
@@ -867,9 +1314,11 @@ struct file_struct *make_file(char *fname, struct file_list *flist,
 
 	alloc_len = file_struct_len + dirname_len + basename_len
 		  + linkname_len + sum_len;
-	if (flist)
+	if (flist) {
 		bp = pool_alloc(flist->file_pool, alloc_len, "make_file");
-	else {
+		flist_entries++;
+		flist_entry_bytes += alloc_len;
+	} else {
 		if (!(bp = new_array(char, alloc_len)))
 			out_of_memory("make_file");
 	}
@@ -911,6 +1360,10 @@ struct file_struct *make_file(char *fname, struct file_list *flist,
 		memcpy(bp, dirname, dirname_len - 1);
 		bp += dirname_len;
 		bp[-1] = '\0';
+		if (de) {
+			add_dirname(flist, de, lastdir, lastdir_len,
+				    count_dir_elements(lastdir));
+		}
 	} else if (dirname)
 		file->dirname = dirname;
 
@@ -1066,6 +1519,45 @@ static void send_if_directory(int f, struct file_list *flist,
 	}
 }
 
+/* The names read from one directory, so that we can stat the entries in
+ * inode order.  On most filesystems this visits the inode table
+ * sequentially instead of in the (hashed) readdir order, which makes a big
+ * difference for large directories that aren't in the cache.  The buffers
+ * are reused, since they are done with before we recurse. */
+struct dir_entry {
+	ino_t ino;
+	size_t name_off;
+};
+static struct dir_entry *dir_ents;
+static int dir_ents_max;
+static char *dir_names;
+static size_t dir_names_max;
+
+static int dir_entry_compare(struct dir_entry *e1, struct dir_entry *e2)
+{
+	if (e1->ino != e2->ino)
+		return e1->ino < e2->ino ? -1 : 1;
+	return e1->name_off < e2->name_off ? -1 : 1;
+}
+
+/* Returns the next name in the directory, which comes from the daemon's
+ * flist snapshot when d is NULL. */
+static char *read_dir_name(DIR *d, ino_t *ino_p)
+{
+	struct dirent *di;
+
+#ifdef SUPPORT_FLIST_SNAPSHOT
+	if (!d) {
+		*ino_p = 0;
+		return snapshot_readdir();
+	}
+#endif
+	if (!(di = readdir(d)))
+		return NULL;
+	*ino_p = di->d_ino;
+	return d_name(di);
+}
+
 /* This function is normally called by the sender, but the receiving side also
  * calls it from get_dirlist() with f set to -1 so that we just construct the
  * file list in memory without sending it over the wire.  Also, get_dirlist()
@@ -1074,12 +1566,19 @@ static void send_if_directory(int f, struct file_list *flist,
 static void send_directory(int f, struct file_list *flist,
 			   char *fbuf, int len)
 {
-	struct dirent *di;
 	unsigned remainder;
-	char *p;
+	char *p, *dname;
+	ino_t ino;
 	DIR *d;
 	int start = flist->count;
+	int i, cnt = 0;
+	size_t names_len = 0;
 
+#ifdef SUPPORT_FLIST_SNAPSHOT
+	if (f >= 0 && snapshot_active && snapshot_opendir(fbuf))
+		d = NULL;
+	else
+#endif
 	if (!(d = opendir(fbuf))) {
 		io_error |= IOERR_GENERAL;
 		rsyserr(FERROR, errno, "opendir %s failed", full_fname(fbuf));
@@ -1092,8 +1591,8 @@ static void send_directory(int f, struct file_list *flist,
 	*p = '\0';
 	remainder = MAXPATHLEN - (p - fbuf);
 
-	for (errno = 0, di = readdir(d); di; errno = 0, di = readdir(d)) {
-		char *dname = d_name(di);
+	for (errno = 0, dname = read_dir_name(d, &ino); dname;
+	     errno = 0, dname = read_dir_name(d, &ino)) {
 		if (dname[0] == '.' && (dname[1] == '\0'
 		    || (dname[1] == '.' && dname[2] == '\0')))
 			continue;
@@ -1105,25 +1604,121 @@ static void send_directory(int f, struct file_list *flist,
 			continue;
 		}
 
-		send_file_name(f, flist, fbuf, NULL, 0);
+		if (cnt == dir_ents_max) {
+			dir_ents_max = dir_ents_max ? dir_ents_max * 2 : 1024;
+			dir_ents = realloc_array(dir_ents, struct dir_entry,
+						 dir_ents_max);
+			if (!dir_ents)
+				out_of_memory("send_directory");
+		}
+		if (names_len + strlen(dname) + 1 > dir_names_max) {
+			while (names_len + strlen(dname) + 1 > dir_names_max)
+				dir_names_max = dir_names_max ? dir_names_max * 2 : 32 * 1024;
+			dir_names = realloc_array(dir_names, char, dir_names_max);
+			if (!dir_names)
+				out_of_memory("send_directory");
+		}
+		dir_ents[cnt].ino = ino;
+		dir_ents[cnt].name_off = names_len;
+		names_len += strlcpy(dir_names + names_len, dname,
+				     dir_names_max - names_len) + 1;
+		cnt++;
 	}
 
-	fbuf[len] = '\0';
-
 	if (errno) {
+		char save = fbuf[len];
+		fbuf[len] = '\0';
 		io_error |= IOERR_GENERAL;
 		rsyserr(FERROR, errno, "readdir(%s)", full_fname(fbuf));
+		fbuf[len] = save;
+	}
+
+	if (cnt > 1 && d) {
+		qsort(dir_ents, cnt, sizeof dir_ents[0],
+		      (int (*)(const void *, const void *))dir_entry_compare);
+	}
+
+#ifdef USE_DIRFD_WALK
+	walk_dirfd = d ? dirfd(d) : -1;
+	walk_dir = fbuf;
+	walk_dir_len = p - fbuf;
+#endif
+	for (i = 0; i < cnt; i++) {
+		strlcpy(p, dir_names + dir_ents[i].name_off, remainder);
+		send_file_name(f, flist, fbuf, NULL, 0);
 	}
+#ifdef USE_DIRFD_WALK
+	walk_dirfd = -1;
+#endif
+
+	if (d)
+		closedir(d);
 
-	closedir(d);
+	fbuf[len] = '\0';
 
-	if (recurse) {
-		int i, end = flist->count - 1;
+	if (recurse && !inc_recurse) {
+		int end = flist->count - 1;
 		for (i = start; i <= end; i++)
 			send_if_directory(f, flist, flist->files[i], fbuf, len);
 	}
 }
 
+/* With --inc-recursive, the sender keeps a stack of the ranges of the file
+ * list whose directories it has yet to send sub-lists for, so that they go
+ * out in the same depth-first order that the generator walks them in.  Each
+ * range holds the local filters of the directory it was read from. */
+struct dir_frame {
+	int ndx, end;
+	void *save_filters;
+};
+static struct dir_frame *dir_frames;
+static int dir_frame_cnt, dir_frame_max;
+static int sub_lists_done, sub_lists_ahead;
+
+static void push_dir_frame(int start, int end, void *save_filters)
+{
+	struct dir_frame *fr;
+
+	if (dir_frame_cnt == dir_frame_max) {
+		dir_frame_max = dir_frame_max ? dir_frame_max * 2 : 32;
+		dir_frames = realloc_array(dir_frames, struct dir_frame,
+					   dir_frame_max);
+		if (!dir_frames)
+			out_of_memory("push_dir_frame");
+	}
+	fr = &dir_frames[dir_frame_cnt++];
+	fr->ndx = start;
+	fr->end = end;
+	fr->save_filters = save_filters;
+}
+
+/* Returns the index of the next directory to send a sub-list for, or -1
+ * when there are none left. */
+static int next_sub_list_dir(struct file_list *flist)
+{
+	while (dir_frame_cnt) {
+		struct dir_frame *fr = &dir_frames[dir_frame_cnt-1];
+		struct file_struct *file;
+
+		if (fr->ndx == fr->end) {
+			/* The first range's entries came from no directory. */
+			if (dir_frame_cnt > 1)
+				pop_local_filters(fr->save_filters);
+			dir_frame_cnt--;
+			continue;
+		}
+		file = flist->files[fr->ndx++];
+		if (!file->basename || !S_ISDIR(file->mode)
+		 || file->flags & FLAG_MOUNT_POINT)
+			continue;
+		if (dir_frame_cnt == 1 && !(file->flags & FLAG_TOP_DIR))
+			continue;
+		return fr->ndx - 1;
+	}
+
+	return -1;
+}
+
 struct file_list *send_file_list(int f, int argc, char *argv[])
 {
 	int len;
@@ -1141,8 +1736,13 @@ struct file_list *send_file_list(int f, int argc, char *argv[])
 
 	start_write = stats.total_written;
 	gettimeofday(&start_tv, NULL);
+	start_throughput_probe();
 
 	flist = flist_new(WITH_HLINK, "send_file_list");
+#ifdef SUPPORT_FLIST_SPILL
+	if (flist_spill_dir)
+		flist_spill_start(flist);
+#endif
 
 	io_start_buffering_out();
 	if (filesfrom_fd >= 0) {
@@ -1337,7 +1937,7 @@ struct file_list *send_file_list(int f, int argc, char *argv[])
 		if (recurse || (xfer_dirs && is_dot_dir)) {
 			struct file_struct *file;
 			file = send_file_name(f, flist, fbuf, &st, FLAG_TOP_DIR);
-			if (file)
+			if (file && !inc_recurse)
 				send_if_directory(f, flist, file, fbuf, len);
 		} else
 			send_file_name(f, flist, fbuf, &st, 0);
@@ -1377,8 +1977,12 @@ struct file_list *send_file_list(int f, int argc, char *argv[])
 	/* Sort the list without removing any duplicates.  This allows the
 	 * receiving side to ask for any name they like, which gives us the
 	 * flexibility to change the way we unduplicate names in the future
-	 * without causing a compatibility problem with older versions. */
-	clean_flist(flist, 0, 0);
+	 * without causing a compatibility problem with older versions.  An
+	 * incremental list must drop the same ones as the receiver, though,
+	 * so that we only send the sub-list of the directory it keeps. */
+	clean_flist(flist, 0, inc_recurse);
+	if (inc_recurse)
+		push_dir_frame(0, flist->count, NULL);
 
 	send_uid_list(f);
 
@@ -1389,6 +1993,8 @@ struct file_list *send_file_list(int f, int argc, char *argv[])
 	stats.flist_size = stats.total_written - start_write;
 	stats.num_files = flist->count;
 
+	adapt_socket_buffers(f);
+
 	if (verbose > 3)
 		output_flist(flist);
 
@@ -1398,25 +2004,113 @@ struct file_list *send_file_list(int f, int argc, char *argv[])
 	return flist;
 }
 
-struct file_list *recv_file_list(int f)
+/* Returns 1 if the sender may send another sub-list while it is idle: it
+ * stays only a few sub-lists ahead of the generator, so that the scan
+ * doesn't run far ahead of the transfer. */
+int sub_list_wanted(void)
 {
-	struct file_list *flist;
-	unsigned short flags;
-	int64 start_read;
+	return !sub_lists_done && sub_lists_ahead < MAX_SUB_LISTS_AHEAD;
+}
 
-	rprintf(FLOG, "receiving file list\n");
-	if (show_filelist_p())
-		start_filelist_progress("receiving file list");
+/* The sender calls this when the generator says it has used a sub-list. */
+void sub_list_taken(void)
+{
+	if (sub_lists_ahead > 0)
+		sub_lists_ahead--;
+}
 
-	start_read = stats.total_read;
+/* For --inc-recursive, this sends the sub-list of the next directory (in
+ * depth-first order) whose contents the receiving side doesn't have yet.
+ * Returns 0 when there are none left, after sending the NDX_FLIST_EOF that
+ * tells the other side so. */
+int send_sub_list(int f, struct file_list *flist)
+{
+	char fbuf[MAXPATHLEN], olddir[sizeof curr_dir];
+	struct file_struct *file;
+	void *save_filters;
+	STRUCT_STAT st;
+	int ndx, start, len = 0;
 
-	flist = flist_new(WITH_HLINK, "recv_file_list");
+	if (sub_lists_done)
+		return 0;
 
-	flist->count = 0;
-	flist->malloced = 1000;
-	flist->files = new_array(struct file_struct *, flist->malloced);
-	if (!flist->files)
-		goto oom;
+	if ((ndx = next_sub_list_dir(flist)) < 0) {
+		write_int(f, NDX_FLIST_EOF);
+		sub_lists_done = 1;
+		return 0;
+	}
+	file = flist->files[ndx];
+	start = flist->count;
+
+	write_int(f, NDX_FLIST_DIR);
+	write_int(f, ndx);
+	sub_lists_ahead++;
+
+	/* Even if we can't read the dir, we send an empty sub-list so that
+	 * the io_error goes along before the receiver deletes anything. */
+	olddir[0] = '\0';
+	if (file->dir.root) {
+		strlcpy(olddir, curr_dir, sizeof olddir);
+		if (!push_dir(file->dir.root, 0)) {
+			io_error |= IOERR_GENERAL;
+			rsyserr(FERROR, errno, "push_dir %s failed",
+				full_fname(file->dir.root));
+			olddir[0] = '\0';
+			goto done;
+		}
+		flist_dir = file->dir.root;
+		flist_dir_len = strlen(flist_dir);
+	}
+
+	f_name(file, fbuf);
+	if ((len = strlen(fbuf)) >= MAXPATHLEN - 1) {
+		io_error |= IOERR_GENERAL;
+		rprintf(FERROR, "skipping long-named directory: %s\n",
+			full_fname(fbuf));
+		len = 0;
+		goto done;
+	}
+	if (one_file_system && file->flags & FLAG_TOP_DIR
+	 && link_stat(fbuf, &st, copy_dirlinks) == 0)
+		filesystem_dev = st.st_dev;
+
+	in_sub_list = 1;
+	save_filters = push_local_filters(fbuf, len);
+	send_directory(f, flist, fbuf, len);
+	in_sub_list = 0;
+
+	/* The receiving side sorts the sub-list the same way. */
+	sort_file_list(flist->files + start, flist->count - start);
+	push_dir_frame(start, flist->count, save_filters);
+
+  done:
+	if (olddir[0]) {
+		flist_dir = NULL;
+		flist_dir_len = 0;
+		if (!pop_dir(olddir)) {
+			rsyserr(FERROR, errno, "pop_dir %s failed",
+				full_fname(olddir));
+			exit_cleanup(RERR_FILESELECT);
+		}
+	}
+
+	send_file_entry(NULL, f);
+	send_uid_list(f);
+	write_int(f, lp_ignore_errors(module_id) ? 0 : io_error);
+	stats.num_files = flist->count;
+
+	if (verbose > 2) {
+		rprintf(FINFO, "sent sub-list of %d names for dir %d\n",
+			flist->count - start, ndx);
+	}
+
+	return 1;
+}
+
+/* Reads file entries up to the end of the (sub-)list. */
+static void recv_file_entries(int f, struct file_list *flist)
+{
+	unsigned short flags;
 
 	while ((flags = read_byte(f)) != 0) {
 		struct file_struct *file;
@@ -1453,6 +2147,38 @@ struct file_list *recv_file_list(int f)
 		}
 	}
 	receive_file_entry(NULL, 0, 0); /* Signal that we're done. */
+}
+
+struct file_list *recv_file_list(int f)
+{
+	struct file_list *flist;
+	struct timeval start_tv, end_tv;
+	int64 start_read, usec;
+
+	rprintf(FLOG, "receiving file list\n");
+	if (show_filelist_p())
+		start_filelist_progress("receiving file list");
+
+	start_read = stats.total_read;
+	gettimeofday(&start_tv, NULL);
+	start_throughput_probe();
+
+	flist = flist_new(WITH_HLINK, "recv_file_list");
+
+	flist->count = 0;
+#ifdef SUPPORT_FLIST_SPILL
+	if (flist_spill_dir)
+		flist_spill_start(flist);
+	else
+#endif
+	{
+		flist->malloced = 1000;
+		flist->files = new_array(struct file_struct *, flist->malloced);
+		if (!flist->files)
+			goto oom;
+	}
+
+	recv_file_entries(f, flist);
 
 	if (verbose > 2)
 		rprintf(FINFO, "received %d names\n", flist->count);
@@ -1463,7 +2189,7 @@ struct file_list *recv_file_list(int f)
 	clean_flist(flist, relative_paths, 1);
 
 	if (f >= 0) {
-		recv_uid_list(f, flist);
+		recv_uid_list(f, flist, 0);
 
 		/* Recv the io_error flag */
 		if (lp_ignore_errors(module_id) || ignore_errors)
@@ -1471,6 +2197,10 @@ struct file_list *recv_file_list(int f)
 		else
 			io_error |= read_int(f);
 	}
+#ifdef SUPPORT_FLIST_SPILL
+	/* Not until recv_uid_list() has set every entry's ids. */
+	flist_spill_done(flist);
+#endif
 
 	if (verbose > 3)
 		output_flist(flist);
@@ -1487,6 +2217,15 @@ struct file_list *recv_file_list(int f)
 	stats.flist_size = stats.total_read - start_read;
 	stats.num_files = flist->count;
 
+	gettimeofday(&end_tv, NULL);
+	usec = (int64)(end_tv.tv_sec - start_tv.tv_sec) * 1000000
+	     + (end_tv.tv_usec - start_tv.tv_usec);
+	if (usec > 0)
+		flist_recv_rate = (double)stats.flist_size * 1000000 / usec;
+
+	if (f >= 0)
+		adapt_socket_buffers(f);
+
 	return flist;
 
   oom:
@@ -1494,9 +2233,261 @@ struct file_list *recv_file_list(int f)
 	return NULL;		/* not reached */
 }
 
+/* Reads the sub-list that the sender made of directory ndx for
+ * --inc-recursive, adding its entries to the end of the file list. */
+void recv_sub_list(int f, struct file_list *flist, int ndx)
+{
+	struct file_struct *parent;
+	int i, start = flist->count;
+
+	if (ndx < 0 || ndx >= flist->count
+	 || !S_ISDIR(flist->files[ndx]->mode)) {
+		rprintf(FERROR, "Invalid dir index for sub-list: %d [%s]\n",
+			ndx, who_am_i());
+		exit_cleanup(RERR_PROTOCOL);
+	}
+	parent = flist->files[ndx];
+
+	in_sub_list = 1;
+	recv_file_entries(f, flist);
+	in_sub_list = 0;
+
+	/* This is the order that the sender's indexes refer to. */
+	sort_file_list(flist->files + start, flist->count - start);
+
+	/* The sender only marks the top dirs, but a sub-list's dirs are
+	 * part of its parent's delete hierarchy. */
+	for (i = start; i < flist->count; i++) {
+		struct file_struct *file = flist->files[i];
+		if (S_ISDIR(file->mode))
+			file->flags |= parent->flags & FLAG_DEL_HERE;
+	}
+
+	recv_uid_list(f, flist, start);
+
+	if (lp_ignore_errors(module_id) || ignore_errors)
+		read_int(f);
+	else
+		io_error |= read_int(f);
+
+	stats.num_files = flist->count;
+
+	if (list_only && am_generator) {
+		for (i = start; i < flist->count; i++)
+			list_file_entry(flist->files[i]);
+	}
+}
+
+/* Split a file's name into the pieces that f_name_cmp() effectively
+ * compares, so that we can compare them with memcmp().  Where f_name_cmp()
+ * switches from a directory path to a non-directory item (which must sort
+ * first), we insert a '\0' byte, which sorts before any name character.
+ * A name that runs out sorts before one that doesn't. */
+static int name_pieces(struct file_struct *file, int with_dir,
+		       const char **pieces, int *lens)
+{
+	int n = 0;
+
+	if (with_dir && file->dirname) {
+		if (*file->dirname) {
+			pieces[n] = file->dirname;
+			lens[n++] = strlen(file->dirname);
+		}
+		pieces[n] = "/";
+		lens[n++] = 1;
+	}
+
+	if (protocol_version < 29) {
+		pieces[n] = file->basename;
+		lens[n++] = strlen(file->basename);
+	} else if (!S_ISDIR(file->mode)) {
+		pieces[n] = "";
+		lens[n++] = 1;
+		pieces[n] = file->basename;
+		lens[n++] = strlen(file->basename);
+	} else if (file->basename[0] == '.' && !file->basename[1]) {
+		pieces[n] = "";
+		lens[n++] = 1;
+	} else {
+		pieces[n] = file->basename;
+		lens[n++] = strlen(file->basename);
+		pieces[n] = "/";
+		lens[n++] = 1;
+	}
+
+	return n;
+}
+
+/* This orders names the same as f_name_cmp(), but is a lot faster because
+ * it compares whole runs of bytes at a time.  When the dirnames are the same
+ * (as they are for all the entries we got from one directory), we only need
+ * to look at the basenames. */
+static int fast_name_cmp(struct file_struct *f1, struct file_struct *f2)
+{
+	const char *p1[4], *p2[4];
+	int l1[4], l2[4];
+	int n1, n2, i1 = 0, i2 = 0, o1 = 0, o2 = 0;
+	int with_dir;
+
+	if (!f1->basename)
+		return f2->basename ? -1 : 0;
+	if (!f2->basename)
+		return 1;
+
+	with_dir = f1->dirname != f2->dirname;
+	n1 = name_pieces(f1, with_dir, p1, l1);
+	n2 = name_pieces(f2, with_dir, p2, l2);
+
+	while (1) {
+		int len, dif;
+		if (i1 == n1)
+			return i2 == n2 ? 0 : -1;
+		if (i2 == n2)
+			return 1;
+		len = MIN(l1[i1] - o1, l2[i2] - o2);
+		if ((dif = memcmp(p1[i1] + o1, p2[i2] + o2, len)) != 0)
+			return dif;
+		if ((o1 += len) == l1[i1])
+			i1++, o1 = 0;
+		if ((o2 += len) == l2[i2])
+			i2++, o2 = 0;
+	}
+}
+
 static int file_compare(struct file_struct **file1, struct file_struct **file2)
 {
-	return f_name_cmp(*file1, *file2);
+	return fast_name_cmp(*file1, *file2);
+}
+
+/* Sort the file list into f_name_cmp() order.  The entries for each
+ * directory arrive together, so we sort each such run on its own (which
+ * only needs to compare basenames) and then merge the runs, instead of
+ * sorting the whole list in one go. */
+static void sort_file_list(struct file_struct **files, int count)
+{
+	struct file_struct **src, **dst, **tmp;
+	int *runs, nruns = 0, i, j;
+
+	if (!(runs = new_array(int, count + 1)))
+		out_of_memory("sort_file_list");
+	for (i = 0; i < count; i = j) {
+		for (j = i + 1; j < count; j++) {
+			if (files[j]->dirname != files[i]->dirname)
+				break;
+		}
+		if (j - i > 1) {
+			qsort(files + i, j - i, sizeof files[0],
+			      (int (*)(const void *, const void *))file_compare);
+		}
+		runs[nruns++] = i;
+	}
+	runs[nruns] = count;
+
+	if (nruns > 1) {
+		if (!(tmp = new_array(struct file_struct *, count)))
+			out_of_memory("sort_file_list");
+		src = files;
+		dst = tmp;
+		while (nruns > 1) {
+			int k = 0;
+			for (i = 0; i < nruns; i += 2) {
+				int lo = runs[i], mid = runs[i+1];
+				int hi = i + 1 < nruns ? runs[i+2] : mid;
+				int a = lo, b = mid, d = lo;
+				while (a < mid && b < hi) {
+					if (fast_name_cmp(src[a], src[b]) <= 0)
+						dst[d++] = src[a++];
+					else
+						dst[d++] = src[b++];
+				}
+				while (a < mid)
+					dst[d++] = src[a++];
+				while (b < hi)
+					dst[d++] = src[b++];
+				runs[k++] = lo;
+			}
+			runs[k] = count;
+			nruns = k;
+			tmp = src;
+			src = dst;
+			dst = tmp;
+		}
+		if (src != files)
+			memcpy(files, src, count * sizeof files[0]);
+		free(src == files ? dst : src);
+	}
+
+	free(runs);
+}
+
+/* Hash the name the way f_name_cmp() sees it, so that names it finds equal
+ * hash the same: with protocol 29, a dir named "a/." matches "a". */
+static uint32 file_name_hash(struct file_struct *file)
+{
+	uint32 h = 5381;
+	const uchar *s = (const uchar *)file->basename;
+
+	if (protocol_version >= 29 && S_ISDIR(file->mode)
+	 && s[0] == '.' && !s[1])
+		s = (const uchar *)"";
+	if (file->dirname) {
+		const uchar *d;
+		for (d = (const uchar *)file->dirname; *d; d++)
+			h = h * 33 + *d;
+		if (*s)
+			h = h * 33 + '/';
+	}
+	for ( ; *s; s++)
+		h = h * 33 + *s;
+
+	return h;
+}
+
+/* Build a hash index of the names in a finished (sorted and cleaned) file
+ * list, which flist_find() will then use instead of its binary search.
+ * This is worth it for the receiver's big list when it is going to look up
+ * every name in every destination directory (e.g. for --delete). */
+void flist_index_names(struct file_list *flist)
+{
+	int i, size;
+
+	if (flist->name_index || flist->high < flist->low)
+		return;
+
+	for (size = 1024; size < (flist->high - flist->low + 1) * 2; size *= 2) {}
+	if (!(flist->name_index = new_array(int32, size)))
+		out_of_memory("flist_index_names");
+	memset(flist->name_index, 0, size * sizeof flist->name_index[0]);
+	flist->name_index_size = size;
+
+	for (i = flist->low; i <= flist->high; i++) {
+		uint32 h;
+		if (!flist->files[i]->basename)
+			continue;
+		h = file_name_hash(flist->files[i]);
+		while (flist->name_index[h & (size-1)])
+			h++;
+		flist->name_index[h & (size-1)] = i + 1;
+	}
+}
+
+static int flist_find_indexed(struct file_list *flist, struct file_struct *f)
+{
+	uint32 h = file_name_hash(f);
+	int32 ndx;
+
+	while ((ndx = flist->name_index[h++ & (flist->name_index_size-1)]) != 0) {
+		struct file_struct *fp = flist->files[ndx-1];
+		/* The caller may have narrowed the list since it was indexed. */
+		if (ndx-1 < flist->low || ndx-1 > flist->high
+		 || f_name_cmp(fp, f) != 0)
+			continue;
+		if (protocol_version < 29 && S_ISDIR(fp->mode) != S_ISDIR(f->mode))
+			return -1;
+		return ndx-1;
+	}
+
+	return -1;
 }
 
 /* Search for an identically-named item in the file list.  Note that the
@@ -1506,6 +2497,9 @@ int flist_find(struct file_list *flist, struct file_struct *f)
 	int low = flist->low, high = flist->high;
 	int diff, mid, mid_up;
 
+	if (flist->name_index)
+		return flist_find_indexed(flist, f);
+
 	while (low <= high) {
 		mid = (low + high) / 2;
 		if (flist->files[mid]->basename)
@@ -1601,6 +2595,15 @@ void flist_free(struct file_list *flist)
 {
 	pool_destroy(flist->file_pool);
 	pool_destroy(flist->hlink_pool);
+	if (flist->dirnames)
+		free(flist->dirnames);
+	if (flist->name_index)
+		free(flist->name_index);
+#ifdef SUPPORT_FLIST_SPILL
+	if (flist == spill_flist)
+		flist_spill_free(flist);
+	else
+#endif
 	free(flist->files);
 	free(flist);
 }
@@ -1621,8 +2624,18 @@ static void clean_flist(struct file_list *flist, int strip_root, int no_dups)
 		return;
 	}
 
-	qsort(flist->files, flist->count,
-	    sizeof flist->files[0], (int (*)())file_compare);
+	sort_file_list(flist->files, flist->count);
+
+	if (verbose > 2) {
+		/* Double-check the sort against f_name_cmp(). */
+		for (i = 1; i < flist->count; i++) {
+			if (f_name_cmp(flist->files[i-1], flist->files[i]) > 0) {
+				rprintf(FERROR, "[%s] file list mis-sorted at %s\n",
+					who_am_i(), f_name(flist->files[i], fbuf));
+				exit_cleanup(RERR_PROTOCOL);
+			}
+		}
+	}
 
 	for (i = no_dups? 0 : flist->count; i < flist->count; i++) {
 		if (flist->files[i]->basename) {
@@ -63,6 +63,11 @@ extern int ignore_times;
 extern int size_only;
 extern OFF_T max_size;
 extern OFF_T min_size;
+extern OFF_T whole_file_size;
+extern OFF_T max_sum_size;
+extern double flist_recv_rate;
+extern int bwlimit;
+extern int do_stats;
 extern int io_error;
 extern int allowed_lull;
 extern int sock_f_out;
@@ -83,6 +88,11 @@ extern int read_batch;
 extern int safe_symlinks;
 extern long block_size; /* "long" because popt can't set an int32. */
 extern int max_delete;
+extern int stat_ahead;
+extern int smallest_first;
+extern int inc_recurse;
+extern int msg_fd_in;
+extern int write_batch;
 extern int force_delete;
 extern int one_file_system;
 extern struct stats stats;
@@ -98,6 +108,19 @@ extern int extended_attributes;
 
 static int deletion_count = 0; /* used to implement --max-delete */
 
+/* With --inc-recursive, this is the sub-list of the dir that we're on (or
+ * an empty list if it has none), which is what its deletions go by. */
+static struct file_list dir_sub_list;
+
+/* Used by --whole-file-size to choose between delta and whole-file. */
+static int choose_whole_cnt, choose_delta_cnt;
+static double sum_rate; /* bytes/sec that we read & checksum a basis file */
+static double sum_overhead; /* extra usec per file for the delta path */
+static double sum_big_bytes, sum_big_usec;
+
+/* The portion of a changed file that we guess the delta will match. */
+#define DELTA_MATCH_GUESS 0.5
+
 /* For calling delete_file() */
 #define DEL_FORCE_RECURSE	(1<<1) /* recurse even w/o --force */
 #define DEL_TERSE		(1<<3)
@@ -109,6 +132,300 @@ static int is_backup_file(char *fn)
 	return k > 0 && strcmp(fn+k, backup_suffix) == 0;
 }
 
+/* While we are deleting the contents of a directory we hold it open, and
+ * each item in it is removed relative to that fd.  This saves the kernel
+ * from looking up every component of the path again for each unlink.
+ *
+ * The deletions stay in the generator, one at a time.  With --delete-during
+ * a dir must be cleaned out before recv_generator() puts new items in it
+ * (a file may replace a dir of the same name), so the generator would just
+ * wait on any helper; --max-delete has to stop at exactly NUM; and the
+ * "deleting" lines go out in our message stream in order. */
+#ifdef HAVE_UNLINKAT
+static int del_dirfd = -1;
+#endif
+
+static int push_del_dir(char *dname)
+{
+#ifdef HAVE_UNLINKAT
+	int save_dirfd = del_dirfd;
+#ifdef O_DIRECTORY
+	del_dirfd = open(dname, O_RDONLY | O_DIRECTORY);
+#else
+	del_dirfd = open(dname, O_RDONLY);
+#endif
+	return save_dirfd;
+#else
+	return -1;
+#endif
+}
+
+static void pop_del_dir(UNUSED(int save_dirfd))
+{
+#ifdef HAVE_UNLINKAT
+	if (del_dirfd >= 0)
+		close(del_dirfd);
+	del_dirfd = save_dirfd;
+#endif
+}
+
+static int del_unlink(char *fname)
+{
+#ifdef HAVE_UNLINKAT
+	if (del_dirfd >= 0) {
+		char *p = strrchr(fname, '/');
+		if (do_unlink_at(del_dirfd, p ? p + 1 : fname) == 0)
+			return 0;
+#ifdef ETXTBSY
+		/* Let robust_unlink() rename a busy file out of the way. */
+		if (errno != ETXTBSY)
+#endif
+			return -1;
+	}
+#endif
+	return robust_unlink(fname);
+}
+
+static int del_rmdir(char *fname)
+{
+#ifdef HAVE_UNLINKAT
+	if (del_dirfd >= 0) {
+		char *p = strrchr(fname, '/');
+		return do_rmdir_at(del_dirfd, p ? p + 1 : fname);
+	}
+#endif
+	return do_rmdir(fname);
+}
+
+
+/* The generator keeps a few directory listings around, keyed by path, so
+ * that the users of a directory don't each read it again.  An entry can
+ * hold a full get_dirlist() scan (which --delete-during hands on to the
+ * --fuzzy code for the destination dir) and/or the sorted names in the dir
+ * (which let try_dests_reg() and try_dests_non() skip the stat of a name
+ * that a --compare-dest, --copy-dest, or --link-dest dir doesn't have).
+ * All but the generator's current dir are dropped when it moves on.
+ *
+ * A name that isn't in the list may still exist under another spelling on
+ * a filesystem that ignores case or Unicode normalization (such as HFS+,
+ * APFS, or a casefolded ext4 dir), so a miss only counts when the name and
+ * every name in the dir are plain ASCII (which no normalization changes)
+ * and the dir doesn't find a name of its own with the case flipped. */
+#define DIR_CACHE_SIZE (MAX_BASIS_DIRS + 2)
+
+struct dir_cache {
+	char *dirname;
+	struct file_list *dirlist;
+	alloc_pool_t name_pool;
+	char **names;
+	int name_cnt;	/* -1 when the names are unknown */
+	int names_read;
+	unsigned int used;
+};
+
+static struct dir_cache dir_cache[DIR_CACHE_SIZE];
+static unsigned int dir_cache_clock;
+
+static void dir_cache_drop(struct dir_cache *dc)
+{
+	free(dc->dirname);
+	if (dc->dirlist)
+		flist_free(dc->dirlist);
+	if (dc->name_pool)
+		pool_destroy(dc->name_pool);
+	if (dc->names)
+		free(dc->names);
+	memset(dc, 0, sizeof dc[0]);
+}
+
+/* Drop every entry but the one for dirname (all of them if NULL). */
+static void dir_cache_keep(char *dirname)
+{
+	int j;
+
+	for (j = 0; j < DIR_CACHE_SIZE; j++) {
+		if (dir_cache[j].dirname && (!dirname
+		 || strcmp(dir_cache[j].dirname, dirname) != 0))
+			dir_cache_drop(&dir_cache[j]);
+	}
+}
+
+static struct dir_cache *dir_cache_find(char *dirname)
+{
+	struct dir_cache *dc = NULL;
+	int j;
+
+	for (j = 0; j < DIR_CACHE_SIZE; j++) {
+		if (!dir_cache[j].dirname) {
+			if (!dc || dc->dirname)
+				dc = &dir_cache[j];
+		} else if (strcmp(dir_cache[j].dirname, dirname) == 0) {
+			dc = &dir_cache[j];
+			dc->used = ++dir_cache_clock;
+			return dc;
+		} else if (!dc || (dc->dirname && dir_cache[j].used < dc->used))
+			dc = &dir_cache[j];
+	}
+
+	if (dc->dirname)
+		dir_cache_drop(dc);
+	if (!(dc->dirname = strdup(dirname)))
+		out_of_memory("dir_cache_find");
+	dc->name_cnt = -1;
+	dc->used = ++dir_cache_clock;
+	return dc;
+}
+
+/* Returns a get_dirlist() scan of dirname that ignores the filter rules,
+ * taking it out of the cache if it is there.  The caller frees it. */
+static struct file_list *take_cached_dirlist(char *dirname)
+{
+	struct dir_cache *dc = dir_cache_find(dirname);
+	struct file_list *dirlist = dc->dirlist;
+
+	if (!dirlist)
+		return get_dirlist(dirname, -1, 1);
+	dc->dirlist = NULL;
+	return dirlist;
+}
+
+static int name_compare(char **name1, char **name2)
+{
+	return strcmp(*name1, *name2);
+}
+
+/* Returns -1 if name isn't plain ASCII, else 1 if it has a letter in it
+ * and 0 if it doesn't. */
+static int ascii_name_kind(char *name)
+{
+	int kind = 0;
+
+	for ( ; *name; name++) {
+		if (*(uchar *)name & 0x80)
+			return -1;
+		if (isalpha(*(uchar *)name))
+			kind = 1;
+	}
+	return kind;
+}
+
+/* Returns 1 if the dir tells apart names that differ only in case:  it
+ * has name (which has a letter in it), so we look up name with the case
+ * of its letters flipped. */
+static int dir_is_case_sensitive(struct dir_cache *dc, char *name)
+{
+	char fbuf[MAXPATHLEN], *flipped;
+	STRUCT_STAT st;
+
+	if (pathjoin(fbuf, sizeof fbuf, dc->dirname, name) >= sizeof fbuf)
+		return 0;
+	for (flipped = name = fbuf + strlen(fbuf) - strlen(name); *name; name++) {
+		if (isupper(*(uchar *)name))
+			*name = tolower(*(uchar *)name);
+		else if (islower(*(uchar *)name))
+			*name = toupper(*(uchar *)name);
+	}
+	if (bsearch(&flipped, dc->names, dc->name_cnt, sizeof dc->names[0],
+		    (int (*)()) name_compare))
+		return 1;
+	return link_stat(fbuf, &st, 0) < 0 && errno == ENOENT;
+}
+
+static void read_dir_names(struct dir_cache *dc)
+{
+	struct dirent *di;
+	int size = 0, has_8bit = 0, read_failed;
+	char *lettered = NULL;
+	DIR *d;
+
+	dc->names_read = 1;
+	if (!(d = opendir(dc->dirname))) {
+		/* A missing dir has none of the names we'll ask about. */
+		if (errno == ENOENT || errno == ENOTDIR)
+			dc->name_cnt = 0;
+		return;
+	}
+
+	if (!(dc->name_pool = pool_create(MAXPATHLEN * 8, 0,
+	    out_of_memory, POOL_INTERN)))
+		out_of_memory("read_dir_names");
+	dc->name_cnt = 0;
+
+	for (errno = 0, di = readdir(d); di; errno = 0, di = readdir(d)) {
+		char *dname = d_name(di);
+		int len = strlen(dname) + 1;
+		if (dname[0] == '.' && (dname[1] == '\0'
+		    || (dname[1] == '.' && dname[2] == '\0')))
+			continue;
+		if (dc->name_cnt == size) {
+			size = size ? size * 2 : 256;
+			dc->names = realloc_array(dc->names, char *, size);
+			if (!dc->names)
+				out_of_memory("read_dir_names");
+		}
+		dc->names[dc->name_cnt] = pool_alloc(dc->name_pool, len,
+						     "read_dir_names");
+		memcpy(dc->names[dc->name_cnt], dname, len);
+		switch (ascii_name_kind(dname)) {
+		case -1:
+			has_8bit = 1;
+			break;
+		case 1:
+			if (!lettered)
+				lettered = dc->names[dc->name_cnt];
+			break;
+		}
+		dc->name_cnt++;
+	}
+	read_failed = errno != 0;
+	closedir(d);
+
+	/* We can't trust a partial list, or one that has a name that a
+	 * normalizing filesystem might match with other bytes. */
+	if (read_failed || has_8bit) {
+		dc->name_cnt = -1;
+		return;
+	}
+	if (dc->name_cnt > 1) {
+		qsort(dc->names, dc->name_cnt, sizeof dc->names[0],
+		      (int (*)()) name_compare);
+	}
+	if (lettered && !dir_is_case_sensitive(dc, lettered))
+		dc->name_cnt = -1;
+}
+
+/* Returns 1 if we know that the named path does not exist because its
+ * dir has been read and the name is not in it. */
+static int cached_name_missing(char *path)
+{
+	char dirbuf[MAXPATHLEN], *name;
+	struct dir_cache *dc;
+	char *slash = strrchr(path, '/');
+
+	if (!slash) {
+		strlcpy(dirbuf, ".", sizeof dirbuf);
+		name = path;
+	} else {
+		int dlen = slash == path ? 1 : slash - path;
+		if (dlen >= (int)sizeof dirbuf)
+			return 0;
+		strlcpy(dirbuf, path, dlen + 1);
+		name = slash + 1;
+	}
+
+	if (ascii_name_kind(name) < 0)
+		return 0;
+
+	dc = dir_cache_find(dirbuf);
+	if (!dc->names_read)
+		read_dir_names(dc);
+	if (dc->name_cnt < 0)
+		return 0;
+
+	return bsearch(&name, dc->names, dc->name_cnt, sizeof dc->names[0],
+		       (int (*)()) name_compare) == NULL;
+}
+
 
 /* Delete a file or directory.  If DEL_FORCE_RECURSE is set in the flags, or if
  * force_delete is set, this will delete recursively.
@@ -119,7 +436,7 @@ static int is_backup_file(char *fn)
 static int delete_item(char *fname, int mode, int flags)
 {
 	struct file_list *dirlist;
-	int j, dlen, zap_dir, ok;
+	int j, dlen, zap_dir, ok, save_dirfd;
 	unsigned remainder;
 	void *save_filters;
 	char *p;
@@ -130,7 +447,7 @@ static int delete_item(char *fname, int mode, int flags)
 		if (make_backups && (backup_dir || !is_backup_file(fname)))
 			ok = make_backup(fname);
 		else
-			ok = robust_unlink(fname) == 0;
+			ok = del_unlink(fname) == 0;
 		if (ok) {
 			if (!(flags & DEL_TERSE))
 				log_delete(fname, mode);
@@ -154,7 +471,7 @@ static int delete_item(char *fname, int mode, int flags)
 	    && !(flags & DEL_FORCE_RECURSE))
 		ok = make_backup(fname);
 	else
-		ok = do_rmdir(fname) == 0;
+		ok = del_rmdir(fname) == 0;
 	if (ok) {
 		if (!(flags & DEL_TERSE))
 			log_delete(fname, mode);
@@ -176,6 +493,7 @@ static int delete_item(char *fname, int mode, int flags)
 	save_filters = push_local_filters(fname, dlen);
 
 	dirlist = get_dirlist(fname, dlen, 0);
+	save_dirfd = push_del_dir(fname);
 
 	p = fname + dlen;
 	if (dlen != 1 || *fname != '/')
@@ -192,6 +510,7 @@ static int delete_item(char *fname, int mode, int flags)
 		delete_item(fname, fp->mode, flags & ~DEL_TERSE);
 	}
 	flist_free(dirlist);
+	pop_del_dir(save_dirfd);
 
 	fname[dlen] = '\0';
 
@@ -200,7 +519,7 @@ static int delete_item(char *fname, int mode, int flags)
 	if (max_delete && ++deletion_count > max_delete)
 		return 0;
 
-	if (do_rmdir(fname) == 0) {
+	if (del_rmdir(fname) == 0) {
 		if (!(flags & DEL_TERSE))
 			log_delete(fname, mode);
 	} else if (errno != ENOTEMPTY && errno != EEXIST && errno != ENOENT) {
@@ -226,7 +545,7 @@ static void delete_in_dir(struct file_list *flist, char *fbuf,
 	static int already_warned = 0;
 	struct file_list *dirlist;
 	char delbuf[MAXPATHLEN];
-	int dlen, i;
+	int dlen, i, save_dirfd, shared;
 
 	if (!flist) {
 		while (cur_depth >= min_depth)
@@ -269,7 +588,11 @@ static void delete_in_dir(struct file_list *flist, char *fbuf,
 			return;
 	}
 
-	dirlist = get_dirlist(fbuf, dlen, 0);
+	/* With --fuzzy we pass our scan of this dir on to recv_generator(),
+	 * so it has no filter rules applied and we check them here. */
+	shared = delete_during && fuzzy_basis;
+	dirlist = get_dirlist(fbuf, dlen, shared);
+	save_dirfd = push_del_dir(fbuf);
 
 	/* If an item in dirlist is not found in flist, delete it
 	 * from the filesystem. */
@@ -279,11 +602,24 @@ static void delete_in_dir(struct file_list *flist, char *fbuf,
 			continue;
 		if (flist_find(flist, fp) < 0) {
 			f_name(fp, delbuf);
+			if (shared) {
+				if (is_excluded(delbuf, S_ISDIR(fp->mode) != 0,
+						ALL_FILTERS))
+					continue;
+				fp->flags |= FLAG_NO_FUZZY;
+			}
 			delete_item(delbuf, fp->mode, DEL_FORCE_RECURSE);
 		}
 	}
 
-	flist_free(dirlist);
+	if (shared) {
+		struct dir_cache *dc = dir_cache_find(fbuf);
+		if (dc->dirlist)
+			flist_free(dc->dirlist);
+		dc->dirlist = dirlist;
+	} else
+		flist_free(dirlist);
+	pop_del_dir(save_dirfd);
 }
 
 /* This deletes any files on the receiving side that are not present on the
@@ -408,8 +744,8 @@ int unchanged_file(char *fn, struct file_struct *file, STRUCT_STAT *st)
  * set (initialize) the size entries in the per-file sum_struct
  * calculating dynamic block and checksum sizes.
  *
- * This is only called from generate_and_send_sums() but is a separate
- * function to encapsulate the logic.
+ * This is called from generate_and_send_sums() and delta_is_cheaper(),
+ * and is a separate function to encapsulate the logic.
  *
  * The block size is a rounded square root of file length.
  *
@@ -419,6 +755,10 @@ int unchanged_file(char *fn, struct file_struct *file, STRUCT_STAT *st)
  * algorithm corrupting data and falling back using the whole md4
  * checksums.
  *
+ * With --max-sum-size, a huge file gets a larger block size so that its
+ * checksums fit in the limit, trading coarser matching for less
+ * signature data when only a small part of the file has changed.
+ *
  * This might be made one of several selectable heuristics.
  */
 static void sum_sizes_sqroot(struct sum_struct *sum, int64 len)
@@ -471,11 +811,14 @@ static void sum_sizes_sqroot(struct sum_struct *sum, int64 len)
 	sum->remainder	= len % blength;
 	sum->count	= len / blength + (sum->remainder != 0);
 
-	if (sum->count && verbose > 2) {
-		rprintf(FINFO,
-			"count=%.0f rem=%ld blength=%ld s2length=%d flength=%.0f\n",
-			(double)sum->count, (long)sum->remainder, (long)sum->blength,
-			sum->s2length, (double)sum->flength);
+	if (max_sum_size && !block_size && blength < MAX_BLOCK_SIZE
+	 && (int64)sum->count * (4 + s2length) > max_sum_size) {
+		int64 max_count = max_sum_size / (4 + s2length);
+		int64 l = (len + MAX(max_count, 1) - 1) / MAX(max_count, 1);
+		l = (l + 7) & ~(int64)7;	/* round up to a multiple of 8 */
+		sum->blength = l > MAX_BLOCK_SIZE ? MAX_BLOCK_SIZE : (int32)l;
+		sum->remainder = len % sum->blength;
+		sum->count = len / sum->blength + (sum->remainder != 0);
 	}
 }
 
@@ -493,6 +836,12 @@ static void generate_and_send_sums(int fd, OFF_T len, int f_out, int f_copy)
 	OFF_T offset = 0;
 
 	sum_sizes_sqroot(&sum, len);
+	if (sum.count && verbose > 2) {
+		rprintf(FINFO,
+			"count=%.0f rem=%ld blength=%ld s2length=%d flength=%.0f\n",
+			(double)sum.count, (long)sum.remainder, (long)sum.blength,
+			sum.s2length, (double)sum.flength);
+	}
 	write_sum_head(f_out, &sum);
 
 	if (append_mode > 0 && f_copy < 0)
@@ -535,6 +884,78 @@ static void generate_and_send_sums(int fd, OFF_T len, int f_out, int f_copy)
 		unmap_file(mapbuf);
 }
 
+/* Time how fast we can checksum data, as a first guess at how fast we can
+ * generate sums for a basis file (see delta_is_cheaper()). */
+static void calibrate_sum_rate(void)
+{
+	char buf[CHUNK_SIZE], sum2[SUM_LENGTH];
+	struct timeval start_tv, tv;
+	int64 bytes = 0, usec;
+	int i;
+
+	for (i = 0; i < (int)sizeof buf; i++)
+		buf[i] = (char)(i * 7 + (i >> 8));
+
+	gettimeofday(&start_tv, NULL);
+	do {
+		get_checksum1(buf, sizeof buf);
+		get_checksum2(buf, sizeof buf, sum2);
+		bytes += sizeof buf;
+		gettimeofday(&tv, NULL);
+		usec = (int64)(tv.tv_sec - start_tv.tv_sec) * 1000000
+		     + (tv.tv_usec - start_tv.tv_usec);
+	} while (usec < 10000);
+
+	sum_rate = (double)bytes * 1000000 / usec;
+}
+
+/* Note how long the delta path took for a basis of "len" bytes (opening
+ * the file and generating its sums), to refine the estimates that are
+ * used by delta_is_cheaper(). */
+static void note_sum_time(OFF_T len, struct timeval *start_tv)
+{
+	struct timeval tv;
+	double usec, extra;
+
+	gettimeofday(&tv, NULL);
+	usec = (double)(tv.tv_sec - start_tv->tv_sec) * 1000000
+	     + (tv.tv_usec - start_tv->tv_usec);
+
+	if (len >= MAX_MAP_SIZE) {
+		sum_big_bytes += len;
+		sum_big_usec += usec;
+		if (sum_big_usec > 0)
+			sum_rate = sum_big_bytes * 1000000 / sum_big_usec;
+	} else if ((extra = usec - len * 1000000 / sum_rate) > 0)
+		sum_overhead = sum_overhead * 0.9 + extra * 0.1;
+}
+
+/* Decide if the rsync algorithm is worth its cost for a file of "len"
+ * bytes that has a basis file of "basis_len" bytes (--whole-file-size=auto).
+ * Sending the file whole costs its size divided by the link rate.  The
+ * delta costs checksumming the basis here and the new file on the sender,
+ * some per-file overhead, and the signature on the wire, in return for not
+ * sending the matched data (which we can only guess at). */
+static int delta_is_cheaper(OFF_T len, OFF_T basis_len)
+{
+	struct sum_struct sum;
+	double link_rate = flist_recv_rate;
+	double delta_usec, saved_usec;
+
+	if (bwlimit && (!link_rate || link_rate > bwlimit * 1024.0))
+		link_rate = bwlimit * 1024.0;
+	if (link_rate <= 0)
+		return 1;
+
+	sum_sizes_sqroot(&sum, basis_len);
+	delta_usec = (double)(basis_len + len) * 1000000 / sum_rate
+		   + sum_overhead
+		   + (double)sum.count * (4 + sum.s2length) * 1000000 / link_rate;
+	saved_usec = DELTA_MATCH_GUESS * MIN(len, basis_len) * 1000000 / link_rate;
+
+	return saved_usec > delta_usec;
+}
+
 
 /* Try to find a filename in the same dir as "fname" with a similar name. */
 static int find_fuzzy(struct file_struct *file, struct file_list *dirlist)
@@ -616,20 +1037,24 @@ static int try_dests_reg(struct file_struct *file, char *fname, int ndx,
 	int best_match = -1;
 	int match_level = 0;
 	int j = 0;
+	STRUCT_STAT best_st;
 
 	do {
 		pathjoin(cmpbuf, MAXPATHLEN, basis_dir[j], fname);
-		if (link_stat(cmpbuf, stp, 0) < 0 || !S_ISREG(stp->st_mode))
+		if (cached_name_missing(cmpbuf)
+		 || link_stat(cmpbuf, stp, 0) < 0 || !S_ISREG(stp->st_mode))
 			continue;
 		switch (match_level) {
 		case 0:
 			best_match = j;
+			best_st = *stp;
 			match_level = 1;
 			/* FALL THROUGH */
 		case 1:
 			if (!unchanged_file(cmpbuf, file, stp))
 				continue;
 			best_match = j;
+			best_st = *stp;
 			match_level = 2;
 			/* FALL THROUGH */
 		case 2:
@@ -651,8 +1076,7 @@ static int try_dests_reg(struct file_struct *file, char *fname, int ndx,
 	if (j != best_match) {
 		j = best_match;
 		pathjoin(cmpbuf, MAXPATHLEN, basis_dir[j], fname);
-		if (link_stat(cmpbuf, stp, 0) < 0)
-			return -1;
+		*stp = best_st;
 	}
 
 	if (match_level == 3 && !copy_dest) {
@@ -717,7 +1141,8 @@ static int try_dests_non(struct file_struct *file, char *fname, int ndx,
 
 	do {
 		pathjoin(fnamebuf, MAXPATHLEN, basis_dir[i], fname);
-		if (link_stat(fnamebuf, &st, 0) < 0 || S_ISDIR(st.st_mode)
+		if (cached_name_missing(fnamebuf)
+		 || link_stat(fnamebuf, &st, 0) < 0 || S_ISDIR(st.st_mode)
 		 || !unchanged_attrs(file, &st))
 			continue;
 		if (S_ISLNK(file->mode)) {
@@ -805,6 +1230,8 @@ static void recv_generator(char *fname, struct file_struct *file, int ndx,
 	char fnamecmpbuf[MAXPATHLEN];
 	uchar fnamecmp_type;
 	int del_opts = DEL_TERSE | (delete_mode ? DEL_FORCE_RECURSE : 0);
+	int xfer_whole = whole_file, chose_whole = 0;
+	struct timeval open_tv;
 
 	if (list_only)
 		return;
@@ -814,6 +1241,7 @@ static void recv_generator(char *fname, struct file_struct *file, int ndx,
 			flist_free(fuzzy_dirlist);
 			fuzzy_dirlist = NULL;
 		}
+		dir_cache_keep(NULL);
 		if (missing_below >= 0) {
 			if (dry_run)
 				dry_run--;
@@ -871,13 +1299,14 @@ static void recv_generator(char *fname, struct file_struct *file, int ndx,
 				flist_free(fuzzy_dirlist);
 				fuzzy_dirlist = NULL;
 			}
+			dir_cache_keep(dn);
 			if (fuzzy_basis)
 				need_fuzzy_dirlist = 1;
 		}
 		parent_dirname = dn;
 
 		if (need_fuzzy_dirlist && S_ISREG(file->mode)) {
-			fuzzy_dirlist = get_dirlist(dn, -1, 1);
+			fuzzy_dirlist = take_cached_dirlist(dn);
 			need_fuzzy_dirlist = 0;
 		}
 
@@ -936,8 +1365,9 @@ static void recv_generator(char *fname, struct file_struct *file, int ndx,
 					"recv_generator: mkdir %s failed",
 					full_fname(fname));
 				file->flags |= FLAG_MISSING;
-				if (ndx+1 < the_file_list->count
-				 && the_file_list->files[ndx+1]->dir.depth > file->dir.depth) {
+				if (inc_recurse ? dir_sub_list.high >= dir_sub_list.low
+				 : (ndx+1 < the_file_list->count
+				  && the_file_list->files[ndx+1]->dir.depth > file->dir.depth)) {
 					rprintf(FERROR,
 					    "*** Skipping everything below this failed directory ***\n");
 					missing_below = file->dir.depth;
@@ -950,7 +1380,8 @@ static void recv_generator(char *fname, struct file_struct *file, int ndx,
 			rprintf(code, "%s/\n", fname);
 		if (delete_during && f_out != -1 && !phase && dry_run < 2
 		    && (file->flags & FLAG_DEL_HERE))
-			delete_in_dir(the_file_list, fname, file, &st);
+			delete_in_dir(inc_recurse ? &dir_sub_list : the_file_list,
+				      fname, file, &st);
 		return;
 	}
 
@@ -1264,7 +1695,22 @@ static void recv_generator(char *fname, struct file_struct *file, int ndx,
 		statret = 0;
 	}
 
-	if (!do_xfers || read_batch || whole_file)
+	if (!xfer_whole && whole_file_size && !append_mode) {
+		/* A delta can't save more than the smaller of the two
+		 * files, so a small file isn't worth reading the basis
+		 * to make a signature. */
+		if (whole_file_size > 0)
+			chose_whole = MIN(st.st_size, file->length) < whole_file_size;
+		else
+			chose_whole = !delta_is_cheaper(file->length, st.st_size);
+		if (chose_whole) {
+			xfer_whole = 1;
+			choose_whole_cnt++;
+		} else
+			choose_delta_cnt++;
+	}
+
+	if (!do_xfers || read_batch || xfer_whole)
 		goto notify_others;
 
 	if (fuzzy_dirlist) {
@@ -1274,6 +1720,7 @@ static void recv_generator(char *fname, struct file_struct *file, int ndx,
 	}
 
 	/* open the file */
+	gettimeofday(&open_tv, NULL);
 	fd = do_open(fnamecmp, O_RDONLY, 0);
 
 	if (fd == -1) {
@@ -1336,6 +1783,8 @@ static void recv_generator(char *fname, struct file_struct *file, int ndx,
 			iflags |= ITEM_BASIS_TYPE_FOLLOWS;
 		if (fnamecmp_type == FNAMECMP_FUZZY)
 			iflags |= ITEM_XNAME_FOLLOWS;
+		if (chose_whole)
+			iflags |= ITEM_SENT_WHOLE;
 		itemize(file, -1, real_ret, &real_st, iflags, fnamecmp_type,
 			fuzzy_file ? fuzzy_file->basename : NULL);
 	}
@@ -1348,13 +1797,16 @@ static void recv_generator(char *fname, struct file_struct *file, int ndx,
 	if (read_batch)
 		return;
 
-	if (statret != 0 || whole_file) {
+	if (statret != 0 || xfer_whole) {
 		write_sum_head(f_out, NULL);
 		return;
 	}
 
 	generate_and_send_sums(fd, st.st_size, f_out, f_copy);
 
+	if (whole_file_size < 0 && f_copy < 0)
+		note_sum_time(st.st_size, &open_tv);
+
 	if (f_copy >= 0) {
 		close(f_copy);
 		set_file_attrs(backupptr, back_file, NULL, 0);
@@ -1368,6 +1820,343 @@ static void recv_generator(char *fname, struct file_struct *file, int ndx,
 	close(fd);
 }
 
+/* With --stat-ahead we fork a helper that lstat()s the destination names
+ * (and any --compare-dest/--link-dest/--copy-dest names) a little ahead of
+ * recv_generator().  The helper's results are thrown away:  the point is to
+ * get the kernel's attribute cache filled while we are busy with earlier
+ * files, which hides most of the round-trip cost of a stat on a network
+ * filesystem.  The generator still does its own stat of every name, so
+ * nothing it decides can be affected by what the helper saw.  The only
+ * thing the helper sends back is how many names it looked up, for the
+ * stats. */
+#ifdef HAVE_SIGACTION
+static struct sigaction sigact;
+#endif
+static pid_t stat_ahead_pid = -1;
+static int stat_ahead_fd = -1, stat_ahead_cnt_fd = -1;
+static int stat_ahead_step;
+static int stat_ahead_cnt; /* names the helper looked up */
+
+/* Returns 1 if there was a name to look up. */
+static int stat_ahead_file(struct file_struct *file)
+{
+	char fname[MAXPATHLEN], cmpbuf[MAXPATHLEN];
+	STRUCT_STAT st;
+	int j;
+
+	if (!file->basename)
+		return 0;
+	f_name(file, fname);
+	if (do_lstat(fname, &st) == 0 || !S_ISREG(file->mode) || !basis_dir[0])
+		return 1;
+	for (j = 0; basis_dir[j]; j++) {
+		pathjoin(cmpbuf, sizeof cmpbuf, basis_dir[j], fname);
+		do_lstat(cmpbuf, &st);
+	}
+	return 1;
+}
+
+/* The helper reads the generator's position from the pipe and keeps no
+ * more than stat_ahead names in front of it.  On EOF it writes its count
+ * to f_out and exits. */
+static void stat_ahead_loop(struct file_list *flist, int f_in, int f_out)
+{
+	int pos = 0, done = 0, cnt = 0, n;
+
+	while (1) {
+		int limit = done + stat_ahead;
+		if (limit > flist->count)
+			limit = flist->count;
+		if (pos < done)
+			pos = done;
+		for ( ; pos < limit; pos++)
+			cnt += stat_ahead_file(flist->files[pos]);
+		if ((n = read(f_in, &done, sizeof done)) < 0 && errno == EINTR)
+			continue;
+		if (n != sizeof done)
+			break;
+	}
+	if (write(f_out, &cnt, sizeof cnt) < 0) {}
+	_exit(0);
+}
+
+static void start_stat_ahead(struct file_list *flist)
+{
+	int fds[2], cnt_fds[2];
+
+	if (pipe(fds) < 0) {
+		rsyserr(FERROR, errno, "pipe failed for --stat-ahead");
+		return;
+	}
+	if (pipe(cnt_fds) < 0) {
+		rsyserr(FERROR, errno, "pipe failed for --stat-ahead");
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	}
+
+	if ((stat_ahead_pid = do_fork()) == -1) {
+		rsyserr(FERROR, errno, "fork failed for --stat-ahead");
+		close(fds[0]);
+		close(fds[1]);
+		close(cnt_fds[0]);
+		close(cnt_fds[1]);
+		return;
+	}
+
+	if (stat_ahead_pid == 0) {
+		/* Die quietly if the transfer is aborted. */
+		SIGACTION(SIGUSR1, SIG_DFL);
+		SIGACTION(SIGUSR2, SIG_DFL);
+		SIGACTION(SIGINT, SIG_DFL);
+		SIGACTION(SIGHUP, SIG_DFL);
+		SIGACTION(SIGTERM, SIG_DFL);
+		close(fds[1]);
+		close(cnt_fds[0]);
+		stat_ahead_loop(flist, fds[0], cnt_fds[1]);
+	}
+
+	close(fds[0]);
+	close(cnt_fds[1]);
+	stat_ahead_fd = fds[1];
+	stat_ahead_cnt_fd = cnt_fds[0];
+	/* Never let a slow helper hold up the generator. */
+	set_nonblocking(stat_ahead_fd);
+	if ((stat_ahead_step = stat_ahead / 4) < 1)
+		stat_ahead_step = 1;
+
+	if (verbose > 2) {
+		rprintf(FINFO, "stat-ahead starting pid=%ld count=%d\n",
+			(long)stat_ahead_pid, stat_ahead);
+	}
+}
+
+static void stat_ahead_progress(int ndx)
+{
+	if (stat_ahead_fd < 0 || ndx % stat_ahead_step)
+		return;
+	/* A full pipe just means the helper is behind, so ignore errors. */
+	if (write(stat_ahead_fd, &ndx, sizeof ndx) < 0) {}
+}
+
+static void stop_stat_ahead(void)
+{
+	int status, n;
+
+	if (stat_ahead_fd < 0)
+		return;
+	close(stat_ahead_fd);
+	stat_ahead_fd = -1;
+	while ((n = read(stat_ahead_cnt_fd, &stat_ahead_cnt,
+			 sizeof stat_ahead_cnt)) < 0 && errno == EINTR) {}
+	if (n != sizeof stat_ahead_cnt)
+		stat_ahead_cnt = 0;
+	close(stat_ahead_cnt_fd);
+	stat_ahead_cnt_fd = -1;
+	wait_process(stat_ahead_pid, &status, 0);
+}
+
+/* With --smallest-first=NUM we hold back up to NUM regular files from one
+ * directory in a heap and hand the smallest of them to recv_generator()
+ * whenever the heap overflows, so a huge file doesn't hold up the small
+ * ones behind it.  The heap is emptied before we move on to another dir or
+ * to any other kind of entry.  That keeps recv_generator()'s per-directory
+ * state (the parent dir, fuzzy list, and missing/excluded dirs) right, and
+ * dirs still come before their contents.  Hard-linked files are never
+ * held back. */
+static int32 *sched_heap;
+static int sched_cnt;
+static char *sched_dirname;
+static int sched_queued, sched_early;
+
+#define SCHED_LESS(flist, a, b) \
+	((flist)->files[a]->length < (flist)->files[b]->length \
+	 || ((flist)->files[a]->length == (flist)->files[b]->length && (a) < (b)))
+
+static void sched_push(struct file_list *flist, int ndx)
+{
+	int pos = sched_cnt++;
+
+	while (pos > 0) {
+		int parent = (pos - 1) / 2;
+		if (!SCHED_LESS(flist, ndx, sched_heap[parent]))
+			break;
+		sched_heap[pos] = sched_heap[parent];
+		pos = parent;
+	}
+	sched_heap[pos] = ndx;
+}
+
+static int sched_pop(struct file_list *flist)
+{
+	int top = sched_heap[0];
+	int last = sched_heap[--sched_cnt];
+	int pos = 0, child, j;
+
+	while ((child = pos * 2 + 1) < sched_cnt) {
+		if (child + 1 < sched_cnt
+		 && SCHED_LESS(flist, sched_heap[child+1], sched_heap[child]))
+			child++;
+		if (!SCHED_LESS(flist, sched_heap[child], last))
+			break;
+		sched_heap[pos] = sched_heap[child];
+		pos = child;
+	}
+	sched_heap[pos] = last;
+
+	/* A held file that comes before this one in the list is bigger. */
+	for (j = 0; j < sched_cnt; j++) {
+		if (sched_heap[j] < top) {
+			sched_early++;
+			break;
+		}
+	}
+	return top;
+}
+
+static void generate_queued(struct file_list *flist, int ndx, int itemizing,
+			    int maybe_ATTRS_REPORT, enum logcode code, int f_out)
+{
+	struct file_struct *file = flist->files[ndx];
+	char fbuf[MAXPATHLEN];
+
+	recv_generator(f_name(file, fbuf), file, ndx, itemizing,
+		       maybe_ATTRS_REPORT, code, f_out);
+	if (preserve_hard_links)
+		check_for_finished_hlinks(itemizing, code);
+}
+
+static void sched_flush(struct file_list *flist, int itemizing,
+			int maybe_ATTRS_REPORT, enum logcode code, int f_out)
+{
+	while (sched_cnt) {
+		generate_queued(flist, sched_pop(flist), itemizing,
+				maybe_ATTRS_REPORT, code, f_out);
+	}
+}
+
+/* Returns 1 if the file was put into the heap instead of being handled
+ * now.  Either way, a file may come out of the heap and be handled. */
+static int schedule_file(struct file_list *flist, int ndx, int itemizing,
+			 int maybe_ATTRS_REPORT, enum logcode code, int f_out)
+{
+	struct file_struct *file = flist->files[ndx];
+	int hold = S_ISREG(file->mode)
+		&& !(preserve_hard_links && file->link_u.links);
+
+	if (sched_cnt && (!hold || (file->dirname != sched_dirname
+	    && (!file->dirname || !sched_dirname
+	     || strcmp(file->dirname, sched_dirname) != 0)))) {
+		sched_flush(flist, itemizing, maybe_ATTRS_REPORT, code, f_out);
+	}
+	if (!hold)
+		return 0;
+
+	sched_dirname = file->dirname;
+	sched_push(flist, ndx);
+	sched_queued++;
+	if (sched_cnt > smallest_first) {
+		generate_queued(flist, sched_pop(flist), itemizing,
+				maybe_ATTRS_REPORT, code, f_out);
+	}
+	return 1;
+}
+
+/* With --inc-recursive we walk the file list depth-first, reading each
+ * dir's sub-list when we get to the dir, so that its contents are handled
+ * before its later siblings (as recv_generator() expects). */
+struct gen_frame {
+	int ndx, end, parent;
+};
+static struct gen_frame *gen_frames;
+static int gen_frame_cnt, gen_frame_max;
+static int next_sub_list = -1; /* its dir's index, or -2 after the last */
+
+static void push_gen_frame(int start, int end, int parent)
+{
+	struct gen_frame *fr;
+
+	if (gen_frame_cnt == gen_frame_max) {
+		gen_frame_max = gen_frame_max ? gen_frame_max * 2 : 32;
+		gen_frames = realloc_array(gen_frames, struct gen_frame,
+					   gen_frame_max);
+		if (!gen_frames)
+			out_of_memory("push_gen_frame");
+	}
+	fr = &gen_frames[gen_frame_cnt++];
+	fr->ndx = start;
+	fr->end = end;
+	fr->parent = parent;
+}
+
+/* Returns the index to handle after i (which is -1 at the start), or -1
+ * when we're done. */
+static int next_gen_ndx(struct file_list *flist, int i)
+{
+	if (!inc_recurse) {
+		if (i < 0)
+			return flist->count ? 0 : -1;
+		return i + 1 < flist->count ? i + 1 : -1;
+	}
+
+	if (i < 0)
+		push_gen_frame(0, flist->count, -1);
+	while (gen_frame_cnt) {
+		struct gen_frame *fr = &gen_frames[gen_frame_cnt-1];
+		if (fr->ndx < fr->end) {
+			struct file_struct *file = flist->files[fr->ndx];
+			/* The final dir-time pass skips these. */
+			if (fr->parent >= 0 && S_ISDIR(file->mode)
+			 && flist->files[fr->parent]->flags & FLAG_MISSING)
+				file->flags |= FLAG_MISSING;
+			return fr->ndx++;
+		}
+		gen_frame_cnt--;
+	}
+
+	return -1;
+}
+
+/* Reads the sub-list of the dir at ndx (which the receiver passes on to
+ * us), if the sender made one, and sets dir_sub_list to it.  Each sub-list
+ * we read is acked to the sender, which then knows that it may send
+ * another (see sub_list_wanted()). */
+static void get_sub_list(int f_out, struct file_list *flist, int ndx)
+{
+	int start = flist->count;
+
+	if (next_sub_list == -1) {
+		int marker = read_int(msg_fd_in);
+		if (marker == NDX_FLIST_DIR)
+			next_sub_list = read_int(msg_fd_in);
+		else if (marker == NDX_FLIST_EOF)
+			next_sub_list = -2;
+		else {
+			rprintf(FERROR, "Invalid sub-list marker: %d [%s]\n",
+				marker, who_am_i());
+			exit_cleanup(RERR_PROTOCOL);
+		}
+	}
+
+	if (next_sub_list == ndx) {
+		next_sub_list = -1;
+		recv_sub_list(msg_fd_in, flist, ndx);
+		push_gen_frame(start, flist->count, ndx);
+		/* Let the sender know it can send another. */
+		write_int(f_out, NDX_FLIST_DIR);
+	}
+
+	dir_sub_list = *flist;
+	dir_sub_list.low = start;
+	dir_sub_list.high = flist->count - 1;
+	dir_sub_list.name_index = NULL;
+}
+
+static int int32_compare(int32 *int1, int32 *int2)
+{
+	return *int1 < *int2 ? -1 : *int1 > *int2;
+}
+
 void generate_files(int f_out, struct file_list *flist, char *local_name)
 {
 	int i;
@@ -1376,7 +2165,8 @@ void generate_files(int f_out, struct file_list *flist, char *local_name)
 	enum logcode code;
 	int lull_mod = allowed_lull * 5;
 	int need_retouch_dir_times = preserve_times && !omit_dir_times;
-	int need_retouch_dir_perms = 0;
+	int32 *retouch_dirs = NULL;
+	int retouch_cnt = 0, retouch_size = 0, retouch_sorted = 1;
 	int save_ignore_existing = ignore_existing;
 	int save_ignore_non_existing = ignore_non_existing;
 	int save_do_progress = do_progress;
@@ -1410,10 +2200,30 @@ void generate_files(int f_out, struct file_list *flist, char *local_name)
 			(long)getpid(), flist->count);
 	}
 
+	if (((delete_mode && !local_name) || keep_dirlinks) && !inc_recurse)
+		flist_index_names(flist);
+
 	if (delete_before && !local_name && flist->count > 0)
 		do_delete_pass(flist);
 	do_progress = 0;
 
+	if (stat_ahead > 0 && !local_name && flist->count > 1)
+		start_stat_ahead(flist);
+
+	/* Batch files record the generator's requests in file-list order. */
+	if (smallest_first > 0 && !local_name && !read_batch && !write_batch) {
+#ifdef HAVE_COPYFILE
+		/* A "._" file must follow its file (see ea_map below). */
+		if (extended_attributes)
+			smallest_first = 0;
+		else
+#endif
+		sched_heap = new_array(int32, smallest_first + 1);
+		if (smallest_first && !sched_heap)
+			out_of_memory("generate_files");
+	} else
+		smallest_first = 0;
+
 	if (append_mode || whole_file < 0)
 		whole_file = 0;
 	if (verbose >= 2) {
@@ -1422,6 +2232,8 @@ void generate_files(int f_out, struct file_list *flist, char *local_name)
 			? "disabled for local transfer or --whole-file"
 			: "enabled");
 	}
+	if (whole_file_size < 0 && !whole_file)
+		calibrate_sum_rate();
 
 	/* Since we often fill up the outgoing socket and then just sit around
 	 * waiting for the other 2 processes to do their thing, we don't want
@@ -1479,8 +2291,9 @@ void generate_files(int f_out, struct file_list *flist, char *local_name)
 	}
 #endif
 
-	for (i = 0; i < flist->count; i++) {
+	for (i = next_gen_ndx(flist, -1); i >= 0; i = next_gen_ndx(flist, i)) {
 		struct file_struct *file = flist->files[i];
+		int need_retouch;
 
 #ifdef HAVE_COPYFILE
 		if (extended_attributes) {
@@ -1502,15 +2315,24 @@ next:		    file = flist->files[i];
 		}
 #endif
 
+		stat_ahead_progress(i);
+
 		if (!file->basename)
 			continue;
 
-		if (local_name)
-			strlcpy(fbuf, local_name, sizeof fbuf);
-		else
-			f_name(file, fbuf);
-		recv_generator(fbuf, file, i, itemizing, maybe_ATTRS_REPORT,
-			       code, f_out);
+		if (inc_recurse && S_ISDIR(file->mode))
+			get_sub_list(f_out, flist, i);
+
+		if (!smallest_first
+		 || !schedule_file(flist, i, itemizing, maybe_ATTRS_REPORT,
+				   code, f_out)) {
+			if (local_name)
+				strlcpy(fbuf, local_name, sizeof fbuf);
+			else
+				f_name(file, fbuf);
+			recv_generator(fbuf, file, i, itemizing,
+				       maybe_ATTRS_REPORT, code, f_out);
+		}
 
 #ifdef HAVE_COPYFILE
 		if (extended_attributes) {
@@ -1525,6 +2347,7 @@ next:		    file = flist->files[i];
 		/* We need to ensure that any dirs we create have writeable
 		 * permissions during the time we are putting files within
 		 * them.  This is then fixed after the transfer is done. */
+		need_retouch = need_retouch_dir_times;
 #ifdef HAVE_CHMOD
 		if (!am_root && S_ISDIR(file->mode) && !(file->mode & S_IWUSR)
 		 && dir_tweaking) {
@@ -1535,10 +2358,26 @@ next:		    file = flist->files[i];
 					"failed to modify permissions on %s",
 					full_fname(fname));
 			}
-			need_retouch_dir_perms = 1;
+			need_retouch = 1;
 		}
 #endif
 
+		/* Remember each dir whose times or perms must be fixed after
+		 * the transfer, so that the final pass doesn't need to walk
+		 * the whole file list. */
+		if (need_retouch && S_ISDIR(file->mode) && dir_tweaking) {
+			if (retouch_cnt == retouch_size) {
+				retouch_size = retouch_size ? retouch_size * 2 : 1024;
+				retouch_dirs = realloc_array(retouch_dirs, int32,
+							     retouch_size);
+				if (!retouch_dirs)
+					out_of_memory("generate_files");
+			}
+			if (retouch_cnt && retouch_dirs[retouch_cnt-1] > i)
+				retouch_sorted = 0;
+			retouch_dirs[retouch_cnt++] = i;
+		}
+
 		if (preserve_hard_links)
 			check_for_finished_hlinks(itemizing, code);
 
@@ -1547,6 +2386,11 @@ next:		    file = flist->files[i];
 		else if (!(i % 200))
 			maybe_flush_socket();
 	}
+	if (smallest_first) {
+		sched_flush(flist, itemizing, maybe_ATTRS_REPORT, code, f_out);
+		free(sched_heap);
+	}
+	stop_stat_ahead();
 	recv_generator(NULL, NULL, 0, 0, 0, code, -1);
 	if (delete_during)
 		delete_in_dir(NULL, NULL, NULL, NULL);
@@ -1607,38 +2451,74 @@ next:		    file = flist->files[i];
 	if (delete_after && !local_name && flist->count > 0)
 		do_delete_pass(flist);
 
-	if ((need_retouch_dir_perms || need_retouch_dir_times) && dir_tweaking) {
-		int j = 0;
+	if (retouch_cnt) {
+		int j;
 		/* Now we need to fix any directory permissions that were
 		 * modified during the transfer and/or re-set any tweaked
 		 * modified-time values. */
-		for (i = 0; i < flist->count; i++) {
-			struct file_struct *file = flist->files[i];
+		if (!retouch_sorted) {
+			qsort(retouch_dirs, retouch_cnt, sizeof retouch_dirs[0],
+			      (int (*)()) int32_compare);
+		}
+		for (j = 0; j < retouch_cnt; j++) {
+			struct file_struct *file = flist->files[retouch_dirs[j]];
 
-			if (!file->basename || !S_ISDIR(file->mode))
-				continue;
-			if (!need_retouch_dir_times && file->mode & S_IWUSR)
-				continue;
 			if (file->flags & FLAG_MISSING) {
+				/* Skip the recorded dirs in its subtree, which
+				 * ends at the next entry in the file list that
+				 * isn't any deeper.  An --inc-recursive list's
+				 * subtrees aren't in one piece, but the walk
+				 * marked their dirs missing too. */
 				int missing = file->dir.depth;
-				while (++i < flist->count) {
-					file = flist->files[i];
-					if (file->dir.depth <= missing)
+				if (inc_recurse)
+					continue;
+				for (i = retouch_dirs[j] + 1; i < flist->count; i++) {
+					if (flist->files[i]->dir.depth <= missing)
 						break;
 				}
-				i--;
+				while (j + 1 < retouch_cnt && retouch_dirs[j+1] < i)
+					j++;
 				continue;
 			}
-			recv_generator(f_name(file, NULL), file, i, itemizing,
-				       maybe_ATTRS_REPORT, code, -1);
-			if (allowed_lull && !(++j % lull_mod))
+			recv_generator(f_name(file, NULL), file, retouch_dirs[j],
+				       itemizing, maybe_ATTRS_REPORT, code, -1);
+			if (allowed_lull && !((j+1) % lull_mod))
 				maybe_send_keepalive();
-			else if (!(j % 200))
+			else if (!((j+1) % 200))
 				maybe_flush_socket();
 		}
+		free(retouch_dirs);
 	}
 	recv_generator(NULL, NULL, 0, 0, 0, code, -1);
 
+	if (stat_ahead_pid > 0 && (do_stats || verbose > 1)) {
+		rprintf(FINFO, "Names looked up by --stat-ahead: %d\n",
+			stat_ahead_cnt);
+	}
+
+	if (smallest_first && (do_stats || verbose > 1)) {
+		rprintf(FINFO,
+			"Files held back by --smallest-first: %d (%d sent ahead of a larger file)\n",
+			sched_queued, sched_early);
+	}
+
+	if (whole_file_size && !whole_file && (do_stats || verbose > 1)) {
+		rprintf(FINFO,
+			"Files sent whole by --whole-file-size: %d (%d used the delta)\n",
+			choose_whole_cnt, choose_delta_cnt);
+		if (whole_file_size < 0) {
+			rprintf(FINFO,
+				"  (checksum rate %s bytes/sec, link rate %s bytes/sec)\n",
+				human_dnum(sum_rate, 0), human_dnum(flist_recv_rate, 0));
+		}
+	}
+
+	if (flist->name_index && (do_stats || verbose > 1)) {
+		rprintf(FINFO, "File-list name index: %s bytes\n",
+			human_num((int64)flist->name_index_size
+				* sizeof flist->name_index[0]));
+	}
+
 	if (max_delete > 0 && deletion_count > max_delete) {
 		rprintf(FINFO,
 			"Deletions stopped due to --max-delete limit (%d skipped)\n",
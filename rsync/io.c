@@ -75,7 +75,7 @@ static int write_batch_monitor_out = -1;
 
 static int io_filesfrom_f_in = -1;
 static int io_filesfrom_f_out = -1;
-static char io_filesfrom_buf[2048];
+static char io_filesfrom_buf[FILESFROM_BUFSIZE];
 static char *io_filesfrom_bp;
 static char io_filesfrom_lastchar;
 static int io_filesfrom_buflen;
@@ -109,6 +109,17 @@ struct msg_list {
 
 static struct msg_list msg2genr, msg2sndr;
 
+/* With --inc-recursive, the receiver copies each sub-list it reads from the
+ * sender into MSG_FLIST messages for the generator, which collects their
+ * data here and reads the sub-list from it just as the receiver did. */
+static char *flist_fwd_buf;
+static size_t flist_fwd_size, flist_fwd_len, flist_fwd_pos;
+static int flist_fwd_active;
+
+/* While the sender of an --inc-recursive transfer waits for the generator's
+ * next request, it sends the next directory's sub-list to this fd. */
+static int sub_list_f_out = -1;
+
 static void flist_ndx_push(struct flist_ndx_list *lp, int ndx)
 {
 	struct flist_ndx_item *item;
@@ -261,6 +272,30 @@ static void read_msg_fd(void)
 			decrement_active_files(IVAL(buf,0));
 		flist_ndx_push(&redo_list, IVAL(buf,0));
 		break;
+	case MSG_FLIST:
+		if (!am_generator) {
+			rprintf(FERROR, "invalid message %d:%d\n", tag, len);
+			exit_cleanup(RERR_STREAMIO);
+		}
+		if (flist_fwd_pos) {
+			flist_fwd_len -= flist_fwd_pos;
+			memmove(flist_fwd_buf, flist_fwd_buf + flist_fwd_pos,
+				flist_fwd_len);
+			flist_fwd_pos = 0;
+		}
+		if (flist_fwd_len + len > flist_fwd_size) {
+			while (flist_fwd_len + len > flist_fwd_size) {
+				flist_fwd_size = flist_fwd_size
+					       ? flist_fwd_size * 2 : 64 * 1024;
+			}
+			flist_fwd_buf = realloc_array(flist_fwd_buf, char,
+						      flist_fwd_size);
+			if (!flist_fwd_buf)
+				out_of_memory("read_msg_fd");
+		}
+		read_loop(fd, flist_fwd_buf + flist_fwd_len, len);
+		flist_fwd_len += len;
+		break;
 	case MSG_DELETED:
 		if (len >= (int)sizeof buf || !am_generator) {
 			rprintf(FERROR, "invalid message %d:%d\n", tag, len);
@@ -477,6 +512,21 @@ static int read_timeout(int fd, char *buf, size_t len)
 		int maxfd = fd;
 		int count;
 
+		if (sub_list_f_out >= 0 && fd == sock_f_in
+		 && sub_list_wanted()) {
+			int f_out = sub_list_f_out;
+			FD_ZERO(&r_fds);
+			FD_SET(fd, &r_fds);
+			tv.tv_sec = tv.tv_usec = 0;
+			if (select(fd + 1, &r_fds, NULL, NULL, &tv) == 0) {
+				sub_list_f_out = -1;
+				if (send_sub_list(f_out, the_file_list))
+					sub_list_f_out = f_out;
+				io_flush(NORMAL_FLUSH);
+				continue;
+			}
+		}
+
 		FD_ZERO(&r_fds);
 		FD_ZERO(&w_fds);
 		FD_SET(fd, &r_fds);
@@ -615,6 +665,13 @@ static int read_timeout(int fd, char *buf, size_t len)
 	return cnt;
 }
 
+/* The --files-from input is read in blocks, and read_filesfrom_line() then
+ * takes the names out of this buffer.  When the names come from the other
+ * side, it only sends more data after it has seen our whole file list, so
+ * reading ahead can't take anything that isn't part of the names. */
+static char filesfrom_rbuf[FILESFROM_BUFSIZE];
+static int filesfrom_rpos, filesfrom_rlen;
+
 /**
  * Read a line into the "fname" buffer (which must be at least MAXPATHLEN
  * characters long).
@@ -629,7 +686,19 @@ int read_filesfrom_line(int fd, char *fname)
   start:
 	s = fname;
 	while (1) {
-		cnt = read(fd, &ch, 1);
+		if (filesfrom_rpos < filesfrom_rlen) {
+			ch = filesfrom_rbuf[filesfrom_rpos++];
+			if (nulls? !ch : (ch == '\r' || ch == '\n')) {
+				/* Skip empty lines if reading locally. */
+				if (!reading_remotely && s == fname)
+					continue;
+				break;
+			}
+			if (s < eob)
+				*s++ = ch;
+			continue;
+		}
+		cnt = read(fd, filesfrom_rbuf, sizeof filesfrom_rbuf);
 		if (cnt < 0 && (errno == EWOULDBLOCK
 		  || errno == EINTR || errno == EAGAIN)) {
 			struct timeval tv;
@@ -648,16 +717,10 @@ int read_filesfrom_line(int fd, char *fname)
 			}
 			continue;
 		}
-		if (cnt != 1)
-			break;
-		if (nulls? !ch : (ch == '\r' || ch == '\n')) {
-			/* Skip empty lines if reading locally. */
-			if (!reading_remotely && s == fname)
-				continue;
+		if (cnt <= 0)
 			break;
-		}
-		if (s < eob)
-			*s++ = ch;
+		filesfrom_rpos = 0;
+		filesfrom_rlen = cnt;
 	}
 	*s = '\0';
 
@@ -670,18 +733,39 @@ int read_filesfrom_line(int fd, char *fname)
 
 static char *iobuf_out;
 static int iobuf_out_cnt;
+static int iobuf_out_siz = IO_BUFFER_SIZE;
 
 void io_start_buffering_out(void)
 {
 	if (iobuf_out)
 		return;
-	if (!(iobuf_out = new_array(char, IO_BUFFER_SIZE)))
+	if (!(iobuf_out = new_array(char, iobuf_out_siz)))
 		out_of_memory("io_start_buffering_out");
 	iobuf_out_cnt = 0;
 }
 
+/* Allow the output buffer to hold up to siz bytes (limited to
+ * MAX_IO_BUFFER_SIZE) before it gets flushed. */
+void io_grow_buffering_out(int siz)
+{
+	if (siz > MAX_IO_BUFFER_SIZE)
+		siz = MAX_IO_BUFFER_SIZE;
+	if (siz <= iobuf_out_siz)
+		return;
+
+	if (iobuf_out) {
+		io_flush(NORMAL_FLUSH);
+		if (iobuf_out_cnt)
+			return;
+		if (!(iobuf_out = realloc_array(iobuf_out, char, siz)))
+			out_of_memory("io_grow_buffering_out");
+	}
+	iobuf_out_siz = siz;
+}
+
 static char *iobuf_in;
 static size_t iobuf_in_siz;
+static size_t iobuf_in_remaining;
 
 void io_start_buffering_in(void)
 {
@@ -721,6 +805,104 @@ void maybe_send_keepalive(void)
 	}
 }
 
+/* Returns 1 if a read from fd would find some data waiting. */
+int io_input_ready(int fd)
+{
+	struct timeval tv;
+	fd_set r_fds;
+
+	if (iobuf_in && fd == sock_f_in && iobuf_in_remaining)
+		return 1;
+
+	FD_ZERO(&r_fds);
+	FD_SET(fd, &r_fds);
+	tv.tv_sec = tv.tv_usec = 0;
+	return select(fd + 1, &r_fds, NULL, NULL, &tv) > 0;
+}
+
+/* Waits on the pipes of a helper process (see --async-finish and
+ * --send-ahead) the way read_timeout() waits on the socket:  we wake up
+ * every select_timeout seconds so that --timeout is enforced, and any sign
+ * of life from the helper counts as I/O.  Returns select()'s count. */
+int io_wait_for_helper(int max_fd, fd_set *r_fds, fd_set *w_fds)
+{
+	struct timeval tv;
+	int cnt;
+
+	tv.tv_sec = select_timeout;
+	tv.tv_usec = 0;
+
+	errno = 0;
+	if ((cnt = select(max_fd + 1, r_fds, w_fds, NULL, &tv)) > 0) {
+		if (io_timeout)
+			last_io_in = time(NULL);
+	} else if (errno != EINTR)
+		check_timeout();
+
+	return cnt;
+}
+
+/* Used by send_files() around its read of the generator's next request. */
+void io_set_sub_list_fd(int fd)
+{
+	sub_list_f_out = fd;
+}
+
+static void flist_fwd_copy(char *buf, size_t len)
+{
+	if (!flist_fwd_buf) {
+		flist_fwd_size = 64 * 1024;
+		if (!(flist_fwd_buf = new_array(char, flist_fwd_size)))
+			out_of_memory("flist_fwd_copy");
+	}
+
+	while (len) {
+		size_t n = MIN(len, flist_fwd_size - flist_fwd_len);
+		memcpy(flist_fwd_buf + flist_fwd_len, buf, n);
+		flist_fwd_len += n;
+		buf += n;
+		len -= n;
+		if (flist_fwd_len == flist_fwd_size) {
+			send_msg(MSG_FLIST, flist_fwd_buf, flist_fwd_len);
+			flist_fwd_len = 0;
+		}
+	}
+}
+
+/* The receiver calls this when it reads the marker that starts a sub-list
+ * (or ends them), and io_end_flist_forward() when it has read the rest. */
+void io_start_flist_forward(int ndx)
+{
+	char b[4];
+
+	flist_fwd_active = 1;
+	flist_fwd_len = 0;
+	SIVAL(b, 0, ndx);
+	flist_fwd_copy(b, 4);
+}
+
+void io_end_flist_forward(void)
+{
+	flist_fwd_active = 0;
+	if (flist_fwd_len)
+		send_msg(MSG_FLIST, flist_fwd_buf, flist_fwd_len);
+	flist_fwd_len = 0;
+}
+
+/* The generator's reads of a sub-list come from the forwarded data, and
+ * we wait for more of it from the receiver when we run out. */
+static int read_flist_fwd(char *buf, size_t len)
+{
+	while (flist_fwd_pos == flist_fwd_len)
+		read_msg_fd();
+
+	len = MIN(len, flist_fwd_len - flist_fwd_pos);
+	memcpy(buf, flist_fwd_buf + flist_fwd_pos, len);
+	flist_fwd_pos += len;
+
+	return len;
+}
+
 /**
  * Continue trying to read len bytes - don't return until len has been
  * read.
@@ -743,26 +925,28 @@ static void read_loop(int fd, char *buf, size_t len)
  */
 static int readfd_unbuffered(int fd, char *buf, size_t len)
 {
-	static size_t remaining;
 	static size_t iobuf_in_ndx;
 	size_t msg_bytes;
 	int tag, cnt = 0;
 	char line[BIGPATHBUFLEN];
 
+	if (am_generator && fd == msg_fd_in && fd >= 0)
+		return read_flist_fwd(buf, len);
+
 	if (!iobuf_in || fd != sock_f_in)
 		return read_timeout(fd, buf, len);
 
-	if (!io_multiplexing_in && remaining == 0) {
-		remaining = read_timeout(fd, iobuf_in, iobuf_in_siz);
+	if (!io_multiplexing_in && iobuf_in_remaining == 0) {
+		iobuf_in_remaining = read_timeout(fd, iobuf_in, iobuf_in_siz);
 		iobuf_in_ndx = 0;
 	}
 
 	while (cnt == 0) {
-		if (remaining) {
-			len = MIN(len, remaining);
+		if (iobuf_in_remaining) {
+			len = MIN(len, iobuf_in_remaining);
 			memcpy(buf, iobuf_in + iobuf_in_ndx, len);
 			iobuf_in_ndx += len;
-			remaining -= len;
+			iobuf_in_remaining -= len;
 			cnt = len;
 			break;
 		}
@@ -782,7 +966,7 @@ static int readfd_unbuffered(int fd, char *buf, size_t len)
 				iobuf_in_siz = msg_bytes;
 			}
 			read_loop(fd, iobuf_in, msg_bytes);
-			remaining = msg_bytes;
+			iobuf_in_remaining = msg_bytes;
 			iobuf_in_ndx = 0;
 			break;
 		case MSG_DELETED:
@@ -825,7 +1009,7 @@ static int readfd_unbuffered(int fd, char *buf, size_t len)
 		}
 	}
 
-	if (remaining == 0)
+	if (iobuf_in_remaining == 0)
 		io_flush(NORMAL_FLUSH);
 
 	return cnt;
@@ -851,6 +1035,9 @@ static void readfd(int fd, char *buffer, size_t N)
 			exit_cleanup(RERR_FILEIO);
 	}
 
+	if (flist_fwd_active && fd == sock_f_in)
+		flist_fwd_copy(buffer, total);
+
 	if (fd == sock_f_in)
 		stats.total_read += total;
 }
@@ -874,6 +1061,29 @@ int32 read_int(int f)
 	return num;
 }
 
+/* Read a number sent by write_varlong(). */
+int64 read_varlong(int f)
+{
+	int64 num = 0;
+	int shift = 0;
+	uchar ch;
+
+	do {
+		if (shift >= SIZEOF_INT64 * 8)
+			overflow_exit("read_varlong");
+		ch = read_byte(f);
+		num |= (int64)(ch & 0x7F) << shift;
+		shift += 7;
+	} while (ch & 0x80);
+
+	return num;
+}
+
+int32 read_varint(int f)
+{
+	return (int32)read_varlong(f);
+}
+
 int64 read_longint(int f)
 {
 	int64 num;
@@ -1218,7 +1428,7 @@ static void writefd(int fd,char *buf,size_t len)
 	}
 
 	while (len) {
-		int n = MIN((int)len, IO_BUFFER_SIZE - iobuf_out_cnt);
+		int n = MIN((int)len, iobuf_out_siz - iobuf_out_cnt);
 		if (n > 0) {
 			memcpy(iobuf_out+iobuf_out_cnt, buf, n);
 			buf += n;
@@ -1226,7 +1436,7 @@ static void writefd(int fd,char *buf,size_t len)
 			iobuf_out_cnt += n;
 		}
 
-		if (iobuf_out_cnt == IO_BUFFER_SIZE)
+		if (iobuf_out_cnt == iobuf_out_siz)
 			io_flush(NORMAL_FLUSH);
 	}
 }
@@ -1271,6 +1481,31 @@ void write_longint(int f, int64 x)
 #endif
 }
 
+/* Send a number 7 bits at a time, low bits first, with the top bit of each
+ * byte set if more bytes follow.  Small numbers (which most of the numbers
+ * in a file list are) take 1 or 2 bytes instead of 4 or 8. */
+void write_varlong(int f, int64 x)
+{
+	char b[(SIZEOF_INT64 * 8 + 6) / 7];
+	int cnt = 0;
+
+	do {
+		b[cnt] = (char)(x & 0x7F);
+		/* Mask off the sign bits that a signed shift brings in. */
+		x = (x >> 7) & (((int64)1 << (SIZEOF_INT64 * 8 - 7)) - 1);
+		if (x)
+			b[cnt] |= 0x80;
+		cnt++;
+	} while (x);
+
+	writefd(f, b, cnt);
+}
+
+void write_varint(int f, int32 x)
+{
+	write_varlong(f, (uint32)x);
+}
+
 void write_buf(int f,char *buf,size_t len)
 {
 	writefd(f,buf,len);
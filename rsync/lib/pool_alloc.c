@@ -12,6 +12,10 @@ struct alloc_pool
 	void			(*bomb)();
 						/* function to call if
 						 * malloc fails		*/
+	void			*(*extent_alloc)(size_t);
+	void			(*extent_free)(void *, size_t);
+						/* used instead of malloc
+						 * and free for extents	*/
 	int			flags;
 
 	/* statistical data */
@@ -43,6 +47,20 @@ struct align_test {
  * keep some compilers from complaining about the pointer arithmetic). */
 #define PTR_ADD(b,o)	( (void*) ((char*)(b) + (o)) )
 
+static void
+extent_free(struct alloc_pool *pool, void *start)
+{
+	size_t asize = pool->size;
+
+	if (!pool->extent_free) {
+		free(start);
+		return;
+	}
+	if (pool->flags & POOL_APPEND)
+		asize += sizeof (struct pool_extent);
+	(*pool->extent_free)(start, asize);
+}
+
 alloc_pool_t
 pool_create(size_t size, size_t quantum,
     void (*bomb)(char *), int flags)
@@ -78,13 +96,13 @@ pool_destroy(alloc_pool_t p)
 
 	if (pool->live) {
 		cur = pool->live;
-		free(cur->start);
+		extent_free(pool, cur->start);
 		if (!(pool->flags & POOL_APPEND))
 			free(cur);
 	}
 	for (cur = pool->free; cur; cur = next) {
 		next = cur->next;
-		free(cur->start);
+		extent_free(pool, cur->start);
 		if (!(pool->flags & POOL_APPEND))
 			free(cur);
 	}
@@ -125,7 +143,11 @@ pool_alloc(alloc_pool_t p, size_t len, char *bomb)
 		if (pool->flags & POOL_APPEND)
 			asize += sizeof (struct pool_extent);
 
-		if (!(start = (void *) malloc(asize)))
+		if (pool->extent_alloc)
+			start = (*pool->extent_alloc)(asize);
+		else
+			start = (void *) malloc(asize);
+		if (!start)
 			goto bomb;
 
 		if (pool->flags & POOL_CLEAR)
@@ -161,6 +183,19 @@ bomb:
 	return NULL;
 }
 
+/* Get the pool's extents from alloc() and give them back to release()
+ * (which is passed the size that alloc() was asked for) instead of using
+ * malloc() and free().  Call this before the first pool_alloc(). */
+void
+pool_set_extents(alloc_pool_t p, void *(*alloc)(size_t),
+    void (*release)(void *, size_t))
+{
+	struct alloc_pool *pool = (struct alloc_pool *) p;
+
+	pool->extent_alloc = alloc;
+	pool->extent_free = release;
+}
+
 void
 pool_free(alloc_pool_t p, size_t len, void *addr)
 {
@@ -225,7 +260,7 @@ pool_free(alloc_pool_t p, size_t len, void *addr)
 	if (cur->free + cur->bound >= pool->size) {
 		pool->free = cur->next;
 
-		free(cur->start);
+		extent_free(pool, cur->start);
 		if (!(pool->flags & POOL_APPEND))
 			free(cur);
 		pool->e_freed++;
@@ -11,6 +11,8 @@ alloc_pool_t pool_create(size_t size, size_t quantum, void (*bomb)(char *), int
 void pool_destroy(alloc_pool_t pool);
 void *pool_alloc(alloc_pool_t pool, size_t size, char *bomb);
 void pool_free(alloc_pool_t pool, size_t size, void *addr);
+void pool_set_extents(alloc_pool_t pool, void *(*alloc)(size_t),
+		      void (*release)(void *, size_t));
 
 #define pool_talloc(pool, type, count, bomb) \
 	((type *)pool_alloc(pool, sizeof(type) * count, bomb))
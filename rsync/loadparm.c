@@ -126,6 +126,7 @@ typedef struct
 	char *exclude;
 	char *exclude_from;
 	char *filter;
+	char *flist_snapshot;
 	char *gid;
 	char *hosts_allow;
 	char *hosts_deny;
@@ -145,6 +146,7 @@ typedef struct
 	char *temp_dir;
 	char *uid;
 
+	int flist_snapshot_refresh;
 	int max_connections;
 	int max_verbosity;
 	int syslog_facility;
@@ -174,6 +176,7 @@ static service sDefault =
  /* exclude; */			NULL,
  /* exclude_from; */		NULL,
  /* filter; */			NULL,
+ /* flist_snapshot; */		NULL,
  /* gid; */			NOBODY_GROUP,
  /* hosts_allow; */		NULL,
  /* hosts_deny; */		NULL,
@@ -193,6 +196,7 @@ static service sDefault =
  /* temp_dir; */ 		NULL,
  /* uid; */			NOBODY_USER,
 
+ /* flist_snapshot_refresh; */	3600,
  /* max_connections; */		0,
  /* max_verbosity; */		1,
  /* syslog_facility; */		LOG_DAEMON,
@@ -301,6 +305,8 @@ static struct parm_struct parm_table[] =
  {"exclude from",      P_STRING, P_LOCAL, &sDefault.exclude_from,      NULL,0},
  {"exclude",           P_STRING, P_LOCAL, &sDefault.exclude,           NULL,0},
  {"filter",            P_STRING, P_LOCAL, &sDefault.filter,            NULL,0},
+ {"flist snapshot refresh",P_INTEGER,P_LOCAL,&sDefault.flist_snapshot_refresh,NULL,0},
+ {"flist snapshot",    P_PATH,   P_LOCAL, &sDefault.flist_snapshot,    NULL,0},
  {"gid",               P_STRING, P_LOCAL, &sDefault.gid,               NULL,0},
  {"hosts allow",       P_STRING, P_LOCAL, &sDefault.hosts_allow,       NULL,0},
  {"hosts deny",        P_STRING, P_LOCAL, &sDefault.hosts_deny,        NULL,0},
@@ -391,6 +397,7 @@ FN_LOCAL_STRING(lp_dont_compress, dont_compress)
 FN_LOCAL_STRING(lp_exclude, exclude)
 FN_LOCAL_STRING(lp_exclude_from, exclude_from)
 FN_LOCAL_STRING(lp_filter, filter)
+FN_LOCAL_STRING(lp_flist_snapshot, flist_snapshot)
 FN_LOCAL_STRING(lp_gid, gid)
 FN_LOCAL_STRING(lp_hosts_allow, hosts_allow)
 FN_LOCAL_STRING(lp_hosts_deny, hosts_deny)
@@ -411,6 +418,7 @@ FN_LOCAL_INTEGER(lp_syslog_facility, syslog_facility)
 FN_LOCAL_STRING(lp_temp_dir, temp_dir)
 FN_LOCAL_STRING(lp_uid, uid)
 
+FN_LOCAL_INTEGER(lp_flist_snapshot_refresh, flist_snapshot_refresh)
 FN_LOCAL_INTEGER(lp_max_connections, max_connections)
 FN_LOCAL_INTEGER(lp_max_verbosity, max_verbosity)
 FN_LOCAL_INTEGER(lp_timeout, timeout)
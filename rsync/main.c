@@ -29,6 +29,7 @@
 extern int verbose;
 extern int dry_run;
 extern int list_only;
+extern int inc_recurse;
 extern int am_root;
 extern int am_server;
 extern int am_sender;
@@ -526,8 +527,11 @@ static char *get_local_name(struct file_list *flist, char *dest_path)
 
 	/* If we need a destination directory because the transfer is not
 	 * of a single non-directory or the user has requested one via a
-	 * destination path ending in a slash, create one and use mode 1. */
-	if (flist->count > 1 || (cp && !cp[1])) {
+	 * destination path ending in a slash, create one and use mode 1.
+	 * (An --inc-recursive dir's contents haven't arrived yet.) */
+	if (flist->count > 1 || (cp && !cp[1])
+	 || (inc_recurse && flist->count == 1
+	  && S_ISDIR(flist->files[0]->mode))) {
 		/* Lop off the final slash (if any). */
 		if (cp && !cp[1])
 			*cp = '\0';
@@ -370,6 +370,22 @@ void match_sums(int f, struct sum_struct *s, struct map_struct *buf, OFF_T len)
 	stats.literal_data += data_transfer;
 }
 
+/* A --send-ahead helper hands the counts for its files back to the parent
+ * sender, which adds them to its own for match_report(). */
+void get_match_totals(int *totals)
+{
+	totals[0] = total_matches;
+	totals[1] = total_hash_hits;
+	totals[2] = total_false_alarms;
+}
+
+void add_match_totals(int *totals)
+{
+	total_matches += totals[0];
+	total_hash_hits += totals[1];
+	total_false_alarms += totals[2];
+}
+
 void match_report(void)
 {
 	if (verbose <= 1)
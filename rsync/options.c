@@ -45,6 +45,8 @@ int append_mode = 0;
 int keep_dirlinks = 0;
 int copy_dirlinks = 0;
 int copy_links = 0;
+int do_fsync = 0;
+int async_finish = 0;
 int preserve_links = 0;
 int preserve_hard_links = 0;
 int preserve_perms = 0;
@@ -84,12 +86,14 @@ int force_delete = 0;
 int io_timeout = 0;
 int allowed_lull = 0;
 int prune_empty_dirs = 0;
+int compact_flist = 0;
 char *files_from = NULL;
 int filesfrom_fd = -1;
 char *filesfrom_host = NULL;
 int eol_nulls = 0;
 int human_readable = 0;
 int recurse = 0;
+int inc_recurse = 0;
 int xfer_dirs = -1;
 int am_daemon = 0;
 int daemon_over_rsh = 0;
@@ -107,8 +111,13 @@ int ignore_existing = 0;
 int ignore_non_existing = 0;
 int need_messages_from_generator = 0;
 int max_delete = 0;
+int stat_ahead = 0;
+int send_ahead = 0;
+int smallest_first = 0;
 OFF_T max_size = 0;
 OFF_T min_size = 0;
+OFF_T whole_file_size = 0;
+OFF_T max_sum_size = 0;
 int ignore_errors = 0;
 int modify_window = 0;
 int blocking_io = -1;
@@ -147,6 +156,7 @@ unsigned int backup_dir_remainder;
 
 char *backup_suffix = NULL;
 char *tmpdir = NULL;
+char *flist_spill_dir = NULL;
 char *partial_dir = NULL;
 char *basis_dir[MAX_BASIS_DIRS+1];
 char *config_file = NULL;
@@ -189,7 +199,8 @@ static int itemize_changes = 0;
 static int refused_delete, refused_archive_part, refused_compress;
 static int refused_partial, refused_progress, refused_delete_before;
 static int refused_inplace;
-static char *max_size_arg, *min_size_arg;
+static char *max_size_arg, *min_size_arg, *whole_file_size_arg;
+static char *max_sum_size_arg;
 static char tmp_partialdir[] = ".~tmp~";
 
 /** Local address to bind.  As a character string because it's
@@ -291,6 +302,7 @@ void usage(enum logcode F)
   rprintf(F," -a, --archive               archive mode; same as -rlptgoD (no -H)\n");
   rprintf(F,"     --no-OPTION             turn off an implied OPTION (e.g. --no-D)\n");
   rprintf(F," -r, --recursive             recurse into directories\n");
+  rprintf(F,"     --inc-recursive         send the file list a directory at a time\n");
   rprintf(F," -R, --relative              use relative path names\n");
   rprintf(F,"     --no-implied-dirs       don't send implied dirs with --relative\n");
   rprintf(F," -b, --backup                make backups (see --suffix & --backup-dir)\n");
@@ -321,8 +333,10 @@ void usage(enum logcode F)
   rprintf(F," -S, --sparse                handle sparse files efficiently\n");
   rprintf(F," -n, --dry-run               show what would have been transferred\n");
   rprintf(F," -W, --whole-file            copy files whole (without rsync algorithm)\n");
+  rprintf(F,"     --whole-file-size=SIZE  copy files smaller than SIZE (or \"auto\") whole\n");
   rprintf(F," -x, --one-file-system       don't cross filesystem boundaries\n");
   rprintf(F," -B, --block-size=SIZE       force a fixed checksum block-size\n");
+  rprintf(F,"     --max-sum-size=SIZE     limit the checksum data sent for any one file\n");
   rprintf(F," -e, --rsh=COMMAND           specify the remote shell to use\n");
   rprintf(F,"     --rsync-path=PROGRAM    specify the rsync to run on the remote machine\n");
   rprintf(F,"     --existing              skip creating new files on receiver\n");
@@ -343,13 +357,20 @@ void usage(enum logcode F)
   rprintf(F,"     --partial-dir=DIR       put a partially transferred file into DIR\n");
   rprintf(F,"     --delay-updates         put all updated files into place at transfer's end\n");
   rprintf(F," -m, --prune-empty-dirs      prune empty directory chains from the file-list\n");
+  rprintf(F,"     --fsync                 make each updated file durable before it is put in place\n");
+  rprintf(F,"     --async-finish          finish received files in a helper process\n");
   rprintf(F,"     --numeric-ids           don't map uid/gid values by user/group name\n");
+  rprintf(F,"     --compact-flist         send the file list in a more compact encoding\n");
+  rprintf(F,"     --flist-spill-dir=DIR   keep the file list in temp files in DIR\n");
   rprintf(F,"     --timeout=TIME          set I/O timeout in seconds\n");
   rprintf(F," -I, --ignore-times          don't skip files that match in size and mod-time\n");
   rprintf(F,"     --size-only             skip files that match in size\n");
   rprintf(F,"     --modify-window=NUM     compare mod-times with reduced accuracy\n");
   rprintf(F," -T, --temp-dir=DIR          create temporary files in directory DIR\n");
   rprintf(F," -y, --fuzzy                 find similar file for basis if no dest file\n");
+  rprintf(F,"     --stat-ahead=NUM        look up NUM destination names ahead of use\n");
+  rprintf(F,"     --send-ahead=NUM        read up to NUM files at once when sending\n");
+  rprintf(F,"     --smallest-first=NUM    send the smallest of each NUM files in a dir first\n");
   rprintf(F,"     --compare-dest=DIR      also compare destination files relative to DIR\n");
   rprintf(F,"     --copy-dest=DIR         ... and include copies of unchanged files\n");
   rprintf(F,"     --link-dest=DIR         hardlink to files in DIR when unchanged\n");
@@ -406,7 +427,7 @@ enum {OPT_VERSION = 1000, OPT_DAEMON, OPT_SENDER, OPT_EXCLUDE, OPT_EXCLUDE_FROM,
       OPT_FILTER, OPT_COMPARE_DEST, OPT_COPY_DEST, OPT_LINK_DEST, OPT_HELP,
       OPT_INCLUDE, OPT_INCLUDE_FROM, OPT_MODIFY_WINDOW, OPT_MIN_SIZE, OPT_CHMOD,
       OPT_READ_BATCH, OPT_WRITE_BATCH, OPT_ONLY_WRITE_BATCH, OPT_MAX_SIZE,
-      OPT_NO_D,
+      OPT_NO_D, OPT_WHOLE_FILE_SIZE, OPT_MAX_SUM_SIZE,
       OPT_SERVER, OPT_REFUSED_BASE = 9000};
 
 static struct poptOption long_options[] = {
@@ -426,6 +447,7 @@ static struct poptOption long_options[] = {
   {"recursive",       'r', POPT_ARG_VAL,    &recurse, 2, 0, 0 },
   {"no-recursive",     0,  POPT_ARG_VAL,    &recurse, 0, 0, 0 },
   {"no-r",             0,  POPT_ARG_VAL,    &recurse, 0, 0, 0 },
+  {"inc-recursive",    0,  POPT_ARG_NONE,   &inc_recurse, 0, 0, 0 },
   {"dirs",            'd', POPT_ARG_VAL,    &xfer_dirs, 2, 0, 0 },
   {"no-dirs",          0,  POPT_ARG_VAL,    &xfer_dirs, 0, 0, 0 },
   {"no-d",             0,  POPT_ARG_VAL,    &xfer_dirs, 0, 0, 0 },
@@ -502,12 +524,17 @@ static struct poptOption long_options[] = {
   {"whole-file",      'W', POPT_ARG_VAL,    &whole_file, 1, 0, 0 },
   {"no-whole-file",    0,  POPT_ARG_VAL,    &whole_file, 0, 0, 0 },
   {"no-W",             0,  POPT_ARG_VAL,    &whole_file, 0, 0, 0 },
+  {"whole-file-size",  0,  POPT_ARG_STRING, &whole_file_size_arg, OPT_WHOLE_FILE_SIZE, 0, 0 },
   {"checksum",        'c', POPT_ARG_NONE,   &always_checksum, 0, 0, 0 },
   {"block-size",      'B', POPT_ARG_LONG,   &block_size, 0, 0, 0 },
+  {"max-sum-size",     0,  POPT_ARG_STRING, &max_sum_size_arg, OPT_MAX_SUM_SIZE, 0, 0 },
   {"compare-dest",     0,  POPT_ARG_STRING, 0, OPT_COMPARE_DEST, 0, 0 },
   {"copy-dest",        0,  POPT_ARG_STRING, 0, OPT_COPY_DEST, 0, 0 },
   {"link-dest",        0,  POPT_ARG_STRING, 0, OPT_LINK_DEST, 0, 0 },
   {"fuzzy",           'y', POPT_ARG_NONE,   &fuzzy_basis, 0, 0, 0 },
+  {"stat-ahead",       0,  POPT_ARG_INT,    &stat_ahead, 0, 0, 0 },
+  {"send-ahead",       0,  POPT_ARG_INT,    &send_ahead, 0, 0, 0 },
+  {"smallest-first",   0,  POPT_ARG_INT,    &smallest_first, 0, 0, 0 },
   {"compress",        'z', POPT_ARG_NONE,   0, 'z', 0, 0 },
   {"compress-level",   0,  POPT_ARG_INT,    &def_compress_level, 'z', 0, 0 },
   {0,                 'P', POPT_ARG_NONE,   0, 'P', 0, 0 },
@@ -518,6 +545,8 @@ static struct poptOption long_options[] = {
   {"partial-dir",      0,  POPT_ARG_STRING, &partial_dir, 0, 0, 0 },
   {"delay-updates",    0,  POPT_ARG_NONE,   &delay_updates, 0, 0, 0 },
   {"prune-empty-dirs",'m', POPT_ARG_NONE,   &prune_empty_dirs, 0, 0, 0 },
+  {"fsync",            0,  POPT_ARG_NONE,   &do_fsync, 0, 0, 0 },
+  {"async-finish",     0,  POPT_ARG_NONE,   &async_finish, 0, 0, 0 },
   {"log-file",         0,  POPT_ARG_STRING, &logfile_name, 0, 0, 0 },
   {"log-file-format",  0,  POPT_ARG_STRING, &logfile_format, 0, 0, 0 },
   {"out-format",       0,  POPT_ARG_STRING, &stdout_format, 0, 0, 0 },
@@ -534,6 +563,8 @@ static struct poptOption long_options[] = {
   {"files-from",       0,  POPT_ARG_STRING, &files_from, 0, 0, 0 },
   {"from0",           '0', POPT_ARG_NONE,   &eol_nulls, 0, 0, 0},
   {"numeric-ids",      0,  POPT_ARG_NONE,   &numeric_ids, 0, 0, 0 },
+  {"compact-flist",    0,  POPT_ARG_NONE,   &compact_flist, 0, 0, 0 },
+  {"flist-spill-dir",  0,  POPT_ARG_STRING, &flist_spill_dir, 0, 0, 0 },
   {"timeout",          0,  POPT_ARG_INT,    &io_timeout, 0, 0, 0 },
   {"rsh",             'e', POPT_ARG_STRING, &shell_cmd, 0, 0, 0 },
   {"rsync-path",       0,  POPT_ARG_STRING, &rsync_path, 0, 0, 0 },
@@ -1055,6 +1086,30 @@ int parse_arguments(int *argc, const char ***argv, int frommain)
 			}
 			break;
 
+		case OPT_MAX_SUM_SIZE:
+			max_sum_size = parse_size_arg(&max_sum_size_arg, 'b');
+			if (max_sum_size <= 0) {
+				snprintf(err_buf, sizeof err_buf,
+					"--max-sum-size value is invalid: %s\n",
+					max_sum_size_arg);
+				return 0;
+			}
+			break;
+
+		case OPT_WHOLE_FILE_SIZE:
+			if (strcmp(whole_file_size_arg, "auto") == 0) {
+				whole_file_size = -1;
+				break;
+			}
+			whole_file_size = parse_size_arg(&whole_file_size_arg, 'b');
+			if (whole_file_size <= 0) {
+				snprintf(err_buf, sizeof err_buf,
+					"--whole-file-size value is invalid: %s\n",
+					whole_file_size_arg);
+				return 0;
+			}
+			break;
+
 		case OPT_LINK_DEST:
 #ifdef SUPPORT_HARD_LINKS
 			link_dest = 1;
@@ -1176,6 +1231,21 @@ int parse_arguments(int *argc, const char ***argv, int frommain)
 		return 0;
 	}
 
+	if (flist_spill_dir) {
+#ifdef SUPPORT_FLIST_SPILL
+		if (strlen(flist_spill_dir) >= MAXPATHLEN - 20) {
+			snprintf(err_buf, sizeof err_buf,
+				 "the --flist-spill-dir path is WAY too long.\n");
+			return 0;
+		}
+#else
+		snprintf(err_buf, sizeof err_buf,
+			 "--flist-spill-dir is not supported on this %s\n",
+			 am_server ? "server" : "client");
+		return 0;
+#endif
+	}
+
 	if (compare_dest + copy_dest + link_dest > 1) {
 		snprintf(err_buf, sizeof err_buf,
 			"You may not mix --compare-dest, --copy-dest, and --link-dest.\n");
@@ -1197,6 +1267,20 @@ int parse_arguments(int *argc, const char ***argv, int frommain)
 	if (!relative_paths)
 		implied_dirs = 0;
 
+	/* These need the whole file list at once, so they fall back to the
+	 * usual single list. */
+	if (inc_recurse && (!recurse || relative_paths || files_from
+	    || delete_before || delete_after || preserve_hard_links
+	    || prune_empty_dirs || keep_dirlinks || delay_updates
+	    || stat_ahead || send_ahead || async_finish || flist_spill_dir
+	    || write_batch || read_batch
+	    || protocol_version < 29))
+		inc_recurse = 0;
+#ifdef HAVE_COPYFILE
+	if (extended_attributes)
+		inc_recurse = 0;
+#endif
+
 	if (!!delete_before + delete_during + delete_after > 1) {
 		snprintf(err_buf, sizeof err_buf,
 			"You may not combine multiple --delete-WHEN options.\n");
@@ -1204,7 +1288,10 @@ int parse_arguments(int *argc, const char ***argv, int frommain)
 	}
 	if (delete_before || delete_during || delete_after)
 		delete_mode = 1;
-	else if (delete_mode || delete_excluded) {
+	else if ((delete_mode || delete_excluded) && inc_recurse) {
+		/* Deleting before the transfer would need the whole list. */
+		delete_mode = delete_during = 1;
+	} else if (delete_mode || delete_excluded) {
 		if (refused_delete_before) {
 			create_refuse_error(refused_delete_before);
 			return 0;
@@ -1242,6 +1329,10 @@ int parse_arguments(int *argc, const char ***argv, int frommain)
 			(*argv)[i] = sanitize_path(NULL, (*argv)[i], "", 0, NULL);
 		if (tmpdir)
 			tmpdir = sanitize_path(NULL, tmpdir, NULL, 0, NULL);
+		if (flist_spill_dir) {
+			flist_spill_dir = sanitize_path(NULL, flist_spill_dir,
+							NULL, 0, NULL);
+		}
 		if (backup_dir)
 			backup_dir = sanitize_path(NULL, backup_dir, NULL, 0, NULL);
 	}
@@ -1254,6 +1345,13 @@ int parse_arguments(int *argc, const char ***argv, int frommain)
 			if (check_filter(elp, tmpdir, 1) < 0)
 				goto options_rejected;
 		}
+		if (flist_spill_dir) {
+			if (!*flist_spill_dir)
+				goto options_rejected;
+			clean_fname(flist_spill_dir, 1);
+			if (check_filter(elp, flist_spill_dir, 1) < 0)
+				goto options_rejected;
+		}
 		if (backup_dir) {
 			if (!*backup_dir)
 				goto options_rejected;
@@ -1643,6 +1741,24 @@ void server_options(char **args,int *argc)
 		args[ac++] = arg;
 	}
 
+	if (stat_ahead && am_sender) {
+		if (asprintf(&arg, "--stat-ahead=%d", stat_ahead) < 0)
+			goto oom;
+		args[ac++] = arg;
+	}
+
+	if (send_ahead && !am_sender) {
+		if (asprintf(&arg, "--send-ahead=%d", send_ahead) < 0)
+			goto oom;
+		args[ac++] = arg;
+	}
+
+	if (smallest_first && am_sender) {
+		if (asprintf(&arg, "--smallest-first=%d", smallest_first) < 0)
+			goto oom;
+		args[ac++] = arg;
+	}
+
 	if (min_size && am_sender) {
 		args[ac++] = "--min-size";
 		args[ac++] = min_size_arg;
@@ -1653,6 +1769,16 @@ void server_options(char **args,int *argc)
 		args[ac++] = max_size_arg;
 	}
 
+	if (whole_file_size && am_sender) {
+		args[ac++] = "--whole-file-size";
+		args[ac++] = whole_file_size_arg;
+	}
+
+	if (max_sum_size && am_sender) {
+		args[ac++] = "--max-sum-size";
+		args[ac++] = max_sum_size_arg;
+	}
+
 	if (io_timeout) {
 		if (asprintf(&arg, "--timeout=%d", io_timeout) < 0)
 			goto oom;
@@ -1733,6 +1859,12 @@ void server_options(char **args,int *argc)
 	if (numeric_ids)
 		args[ac++] = "--numeric-ids";
 
+	if (compact_flist)
+		args[ac++] = "--compact-flist";
+
+	if (inc_recurse)
+		args[ac++] = "--inc-recursive";
+
 	if (ignore_existing && am_sender)
 		args[ac++] = "--ignore-existing";
 
@@ -1745,11 +1877,22 @@ void server_options(char **args,int *argc)
 	else if (inplace)
 		args[ac++] = "--inplace";
 
+	if (do_fsync && am_sender)
+		args[ac++] = "--fsync";
+
+	if (async_finish && am_sender)
+		args[ac++] = "--async-finish";
+
 	if (tmpdir && am_sender) {
 		args[ac++] = "--temp-dir";
 		args[ac++] = tmpdir;
 	}
 
+	if (flist_spill_dir && am_sender) {
+		args[ac++] = "--flist-spill-dir";
+		args[ac++] = flist_spill_dir;
+	}
+
 	if (basis_dir[0] && am_sender) {
 		/* the server only needs this option if it is not the sender,
 		 *   and it may be an older version that doesn't know this
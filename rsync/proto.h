@@ -69,12 +69,18 @@ int unmap_file(struct map_struct *map);
 void init_flist(void);
 void show_flist_stats(void);
 int link_stat(const char *path, STRUCT_STAT *stp, int follow_dirlinks);
+int is_excluded(char *fname, int is_dir, int filter_level);
 void flist_expand(struct file_list *flist);
 struct file_struct *make_file(char *fname, struct file_list *flist,
 			      STRUCT_STAT *stp, unsigned short flags,
 			      int filter_level);
 struct file_list *send_file_list(int f, int argc, char *argv[]);
+int sub_list_wanted(void);
+void sub_list_taken(void);
+int send_sub_list(int f, struct file_list *flist);
 struct file_list *recv_file_list(int f);
+void recv_sub_list(int f, struct file_list *flist, int ndx);
+void flist_index_names(struct file_list *flist);
 int flist_find(struct file_list *flist, struct file_struct *f);
 void clear_file(struct file_struct *file, struct file_list *flist);
 struct file_list *flist_new(int with_hlink, char *msg);
@@ -110,12 +116,20 @@ int get_hlink_num(void);
 void io_set_filesfrom_fds(int f_in, int f_out);
 int read_filesfrom_line(int fd, char *fname);
 void io_start_buffering_out(void);
+void io_grow_buffering_out(int siz);
 void io_start_buffering_in(void);
 void io_end_buffering(void);
 void maybe_flush_socket(void);
 void maybe_send_keepalive(void);
+int io_input_ready(int fd);
+int io_wait_for_helper(int max_fd, fd_set *r_fds, fd_set *w_fds);
+void io_set_sub_list_fd(int fd);
+void io_start_flist_forward(int ndx);
+void io_end_flist_forward(void);
 int read_shortint(int f);
 int32 read_int(int f);
+int64 read_varlong(int f);
+int32 read_varint(int f);
 int64 read_longint(int f);
 void read_buf(int f,char *buf,size_t len);
 void read_sbuf(int f,char *buf,size_t len);
@@ -127,6 +141,8 @@ void io_flush(int flush_it_all);
 void write_shortint(int f, int x);
 void write_int(int f,int32 x);
 void write_longint(int f, int64 x);
+void write_varlong(int f, int64 x);
+void write_varint(int f, int32 x);
 void write_buf(int f,char *buf,size_t len);
 void write_sbuf(int f, char *buf);
 void write_byte(int f, uchar c);
@@ -151,6 +167,7 @@ char *lp_dont_compress(int );
 char *lp_exclude(int );
 char *lp_exclude_from(int );
 char *lp_filter(int );
+char *lp_flist_snapshot(int );
 char *lp_gid(int );
 char *lp_hosts_allow(int );
 char *lp_hosts_deny(int );
@@ -170,6 +187,7 @@ char *lp_secrets_file(int );
 int lp_syslog_facility(int );
 char *lp_temp_dir(int );
 char *lp_uid(int );
+int lp_flist_snapshot_refresh(int );
 int lp_max_connections(int );
 int lp_max_verbosity(int );
 int lp_timeout(int );
@@ -207,6 +225,8 @@ RETSIGTYPE remember_children(UNUSED(int val));
 const char *get_panic_action(void);
 int main(int argc,char *argv[]);
 void match_sums(int f, struct sum_struct *s, struct map_struct *buf, OFF_T len);
+void get_match_totals(int *totals);
+void add_match_totals(int *totals);
 void match_report(void);
 void usage(enum logcode F);
 void option_error(void);
@@ -221,21 +241,30 @@ pid_t local_child(int argc, char **argv, int *f_in, int *f_out,
 		  int (*child_main)(int, char*[]));
 void end_progress(OFF_T size);
 void show_progress(OFF_T ofs, OFF_T size);
+void drop_finish_jobs(void);
 int recv_files(int f_in, struct file_list *flist, char *local_name);
 void setup_iconv();
 void free_sums(struct sum_struct *s);
 mode_t dest_mode(mode_t flist_mode, mode_t stat_mode, int exists);
 int set_file_attrs(char *fname, struct file_struct *file, STRUCT_STAT *st,
 		   int flags);
+int set_file_attrs_fd(char *fname, int fd, struct file_struct *file,
+		      STRUCT_STAT *st, int flags);
 RETSIGTYPE sig_int(UNUSED(int val));
 void finish_transfer(char *fname, char *fnametmp, char *partialptr,
 		     struct file_struct *file, int ok_to_set_time,
-		     int overwriting_basis);
+		     int overwriting_basis, int attrs_set);
 const char *who_am_i(void);
 void successful_send(int ndx);
 int read_item_attrs(int f_in, int f_out, int ndx, uchar *type_ptr,
 		    char *buf, int *len_ptr);
 void send_files(struct file_list *flist, int f_out, int f_in);
+void snapshot_open(const char *fname);
+void snapshot_start(int refresh, int f_in, int f_out);
+int snapshot_stat(const char *path, STRUCT_STAT *stp, int follow_links);
+int snapshot_readlink(const char *path, char *buf, size_t bufsiz);
+int snapshot_opendir(const char *path);
+char *snapshot_readdir(void);
 int try_bind_local(int s, int ai_family, int ai_socktype,
 		   const char *bind_addr);
 int open_socket_out(char *host, int port, const char *bind_addr,
@@ -245,22 +274,40 @@ int open_socket_out_wrapped(char *host, int port, const char *bind_addr,
 int is_a_socket(int fd);
 void start_accept_loop(int port, int (*fn)(int, int));
 void set_socket_options(int fd, char *options);
+void start_rtt_probe(void);
+void finish_rtt_probe(void);
+void start_throughput_probe(void);
+void adapt_socket_buffers(int fd);
 void become_daemon(void);
 int sock_exec(const char *prog);
 int do_unlink(const char *fname);
+int do_unlink_at(int dfd, const char *fname);
+int do_rmdir_at(int dfd, const char *fname);
+void forget_attrs_dir(void);
+char *attrs_dir_name(char *fname, int *dfd_p);
+int do_lchown_at(int dfd, const char *fname, uid_t owner, gid_t group);
+int do_chmod_at(int dfd, const char *fname, mode_t mode);
 int do_symlink(const char *fname1, const char *fname2);
 int do_link(const char *fname1, const char *fname2);
 int do_lchown(const char *path, uid_t owner, gid_t group);
+int do_fchown(int fd, uid_t owner, gid_t group);
 int do_mknod(char *pathname, mode_t mode, dev_t dev);
 int do_rmdir(const char *pathname);
 int do_open(const char *pathname, int flags, mode_t mode);
 int do_chmod(const char *path, mode_t mode);
+int do_fchmod(int fd, mode_t mode);
 int do_rename(const char *fname1, const char *fname2);
 void trim_trailing_slashes(char *name);
 int do_mkdir(char *fname, mode_t mode);
 int do_mkstemp(char *template, mode_t perms);
+int do_open_tmpfile(char *template, mode_t perms);
+int do_link_tmpfile(int fd, char *template);
+void forget_tmpfile(UNUSED(int fd));
+int tmpfile_is_unnamed(UNUSED(int fd));
 int do_stat(const char *fname, STRUCT_STAT *st);
 int do_lstat(const char *fname, STRUCT_STAT *st);
+int do_stat_at(int dfd, const char *fname, STRUCT_STAT *st);
+int do_lstat_at(int dfd, const char *fname, STRUCT_STAT *st);
 int do_fstat(int fd, STRUCT_STAT *st);
 OFF_T do_lseek(int fd, OFF_T offset, int whence);
 char *d_name(struct dirent *di);
@@ -272,7 +319,7 @@ void see_token(char *data, int32 toklen);
 void add_uid(uid_t uid);
 void add_gid(gid_t gid);
 void send_uid_list(int f);
-void recv_uid_list(int f, struct file_list *flist);
+void recv_uid_list(int f, struct file_list *flist, int start);
 void set_nonblocking(int fd);
 void set_blocking(int fd);
 int fd_pair(int fd[2]);
@@ -280,6 +327,9 @@ void print_child_argv(char **cmd);
 NORETURN void out_of_memory(char *str);
 NORETURN void overflow_exit(char *str);
 int set_modtime(char *fname, time_t modtime, mode_t mode);
+int set_modtime_fd(int fd, char *fname, time_t modtime);
+int set_modtime_at(int dfd, char *name, char *fname, time_t modtime,
+		   mode_t mode);
 int mkdir_defmode(char *fname);
 int create_directory_path(char *fname);
 int full_write(int desc, char *ptr, size_t len);
@@ -53,6 +53,9 @@ extern int checksum_seed;
 extern int inplace;
 extern int no_cache;
 extern int delay_updates;
+extern int do_fsync;
+extern int async_finish;
+extern int inc_recurse;
 extern int preserve_links;
 extern struct stats stats;
 extern char *stdout_format;
@@ -287,11 +290,633 @@ static void discard_receive_data(int f_in, OFF_T length)
 	receive_data(f_in, NULL, -1, 0, NULL, -1, length);
 }
 
+/* With --fsync, a file's data is flushed before it is renamed into place,
+ * but the rename itself is only durable once its directory is fsync'd.
+ * Files arrive grouped by directory, so instead of syncing the directory
+ * after every rename we remember it, and sync it once when a file goes
+ * into some other directory (or when we're done). */
+static char fsync_dir[MAXPATHLEN];
+static int fsync_dir_len = -1;
+
+static void sync_renamed_dir(void)
+{
+	char *dname;
+	int fd;
+
+	if (fsync_dir_len < 0)
+		return;
+	dname = fsync_dir_len ? fsync_dir : ".";
+	fsync_dir_len = -1;
+
+	if ((fd = do_open(dname, O_RDONLY, 0)) < 0 || fsync(fd) < 0) {
+		rsyserr(FERROR, errno, "fsync failed on %s",
+			full_fname(dname));
+	}
+	if (fd >= 0)
+		close(fd);
+}
+
+static void note_renamed_file(char *fname)
+{
+	char *slash = strrchr(fname, '/');
+	int len = !slash ? 0 : slash == fname ? 1 : slash - fname;
+
+	if (len == fsync_dir_len && strncmp(fname, fsync_dir, len) == 0)
+		return;
+	sync_renamed_dir();
+	strlcpy(fsync_dir, fname, len + 1);
+	fsync_dir_len = len;
+}
+
+/* Data gets flushed a group of files at a time:  one syncfs() per filesystem
+ * (where we have it) covers everything we wrote there, which is much cheaper
+ * than an fsync() of every file. */
+#define MAX_SYNCED_DEVS 16
+
+struct synced_devs {
+	dev_t devs[MAX_SYNCED_DEVS];
+	int cnt;
+};
+
+static int dev_was_synced(struct synced_devs *sd, dev_t dev)
+{
+	int j;
+
+	for (j = 0; j < sd->cnt; j++) {
+		if (sd->devs[j] == dev)
+			return 1;
+	}
+	return 0;
+}
+
+/* Returns 1 if the syncfs() of fd's filesystem worked. */
+static int syncfs_once(UNUSED(struct synced_devs *sd), UNUSED(int fd),
+		       UNUSED(dev_t dev))
+{
+#ifdef HAVE_SYNCFS
+	if (sd->cnt < MAX_SYNCED_DEVS && syncfs(fd) == 0) {
+		sd->devs[sd->cnt++] = dev;
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+/* For --delay-updates the files' data wasn't synced as they arrived, so we
+ * commit them as a group before any of the renames are done. */
+static void sync_delayed_files(struct file_list *flist, char *local_name)
+{
+	struct synced_devs sd;
+	STRUCT_STAT st;
+	char *fname, *partialptr;
+	int i, fd;
+
+	sd.cnt = 0;
+	for (i = -1; (i = bitbag_next_bit(delayed_bits, i)) >= 0; ) {
+		struct file_struct *file = flist->files[i];
+		fname = local_name ? local_name : f_name(file, NULL);
+		if ((partialptr = partial_dir_fname(fname)) == NULL
+		 || (fd = do_open(partialptr, O_RDONLY, 0)) < 0)
+			continue;
+		if (do_fstat(fd, &st) == 0 && (dev_was_synced(&sd, st.st_dev)
+		 || syncfs_once(&sd, fd, st.st_dev))) {
+			close(fd);
+			continue;
+		}
+		if (fsync(fd) < 0) {
+			rsyserr(FERROR, errno, "fsync failed on %s",
+				full_fname(partialptr));
+		}
+		close(fd);
+	}
+}
+
+/* With --fsync, a finished file isn't renamed into place (and the generator
+ * isn't told about it) right away.  Instead the file joins a group whose
+ * data gets flushed all at once, then all of the group's renames are done,
+ * their directories are synced, and only then do the group's MSG_SUCCESS
+ * and MSG_REDO messages go out (in their original order).  A message with
+ * no pending group in front of it is sent at once.
+ *
+ * With --remove-source-files the generator stops sending us files once 10
+ * or more of them are waiting for a MSG_SUCCESS, so the group has to stay
+ * smaller than that or we'd wait on each other forever.
+ *
+ * A group is also committed once it holds FINISH_GROUP_BYTES of file data,
+ * so that a run of big files doesn't pile up more unsynced data than one
+ * flush should have to write, or once its first file has been waiting for
+ * FINISH_GROUP_SECS, so that a slow link doesn't keep finished files out of
+ * place (and their source files, with --remove-source-files) for long. */
+#define FINISH_GROUP 64
+#define FINISH_GROUP_RSF 8
+#define FINISH_GROUP_BYTES (16*1024*1024)
+#define FINISH_GROUP_SECS 5
+
+#define FJ_FINISH	(1<<0)	/* rename the temp file into place */
+#define FJ_RECV_OK	(1<<1)
+#define FJ_ATTRS_SET	(1<<2)
+#define FJ_DEL_PARTIAL	(1<<3)	/* remove the partial file we used */
+#define FJ_SUCCESS	(1<<4)	/* send MSG_SUCCESS when done */
+#define FJ_REDO		(1<<5)	/* send MSG_REDO when done */
+
+struct finish_job {
+	int32 ndx, flags;
+	mode_t mode;
+	dev_t dev;
+	char *fname, *fnametmp;
+};
+
+static struct finish_job finish_jobs[FINISH_GROUP];
+static int finish_cnt;
+static int64 finish_bytes;
+static time_t finish_start;
+
+/* Start the writeback of a finished file's data, and return the device it
+ * lives on for commit_finish_jobs(). */
+static dev_t start_writeback(int fd)
+{
+	STRUCT_STAT st;
+
+#ifdef HAVE_SYNC_FILE_RANGE
+	sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+	return do_fstat(fd, &st) == 0 ? st.st_dev : (dev_t)-1;
+}
+
+static void sync_finished_data(struct finish_job *fj, struct synced_devs *sd)
+{
+	char *fn = inplace ? fj->fname : fj->fnametmp;
+	int fd;
+
+	if (fj->dev != (dev_t)-1 && dev_was_synced(sd, fj->dev))
+		return;
+	if ((fd = do_open(fn, O_RDONLY, 0)) < 0
+	 || (!(fj->dev != (dev_t)-1 && syncfs_once(sd, fd, fj->dev))
+	  && fsync(fd) < 0)) {
+		rsyserr(FERROR, errno, "fsync failed on %s", full_fname(fn));
+		exit_cleanup(RERR_FILEIO);
+	}
+	close(fd);
+}
+
+static void run_finish_job(struct finish_job *fj)
+{
+	struct file_struct *file = the_file_list->files[fj->ndx];
+	char *fname = fj->fname, *partialptr, *temp_copy_name;
+
+	/* Don't dirty the entry (e.g. a --flist-spill-dir page) needlessly. */
+	if (file->mode != fj->mode)
+		file->mode = fj->mode;
+	partialptr = partial_dir ? partial_dir_fname(fname) : fname;
+	if (partialptr == fname)
+		partialptr = temp_copy_name = NULL;
+	else if (*partial_dir == '/')
+		temp_copy_name = NULL;
+	else
+		temp_copy_name = partialptr;
+	finish_transfer(fname, fj->fnametmp, temp_copy_name, file,
+			fj->flags & FJ_RECV_OK, 1, fj->flags & FJ_ATTRS_SET);
+	if (do_fsync)
+		note_renamed_file(fname);
+	if (fj->flags & FJ_DEL_PARTIAL && partialptr) {
+		do_unlink(partialptr);
+		handle_partial_dir(partialptr, PDIR_DELETE);
+	}
+}
+
+static void send_finish_msgs(struct finish_job *fj)
+{
+	char numbuf[4];
+
+	SIVAL(numbuf, 0, fj->ndx);
+	if (fj->flags & FJ_SUCCESS)
+		send_msg(MSG_SUCCESS, numbuf, 4);
+	if (fj->flags & FJ_REDO)
+		send_msg(MSG_REDO, numbuf, 4);
+}
+
+/* Returns how many files were put into place. */
+static int commit_finish_jobs(void)
+{
+	struct synced_devs sd;
+	int j, files = 0;
+
+	sd.cnt = 0;
+	for (j = 0; do_fsync && j < finish_cnt; j++) {
+		if (finish_jobs[j].flags & FJ_FINISH)
+			sync_finished_data(&finish_jobs[j], &sd);
+	}
+	for (j = 0; j < finish_cnt; j++) {
+		if (finish_jobs[j].flags & FJ_FINISH) {
+			run_finish_job(&finish_jobs[j]);
+			files++;
+		}
+	}
+	sync_renamed_dir();
+	for (j = 0; j < finish_cnt; j++) {
+		send_finish_msgs(&finish_jobs[j]);
+		if (finish_jobs[j].fname)
+			free(finish_jobs[j].fname);
+	}
+	finish_cnt = 0;
+	finish_bytes = 0;
+
+	return files;
+}
+
+static void commit_finish_group(const char *why)
+{
+	int files = commit_finish_jobs();
+
+	if (verbose > 2 && files) {
+		rprintf(FINFO, "fsync group put %d file%s into place (%s)\n",
+			files, files == 1 ? "" : "s", why);
+	}
+}
+
+/* This is called by _exit_cleanup().  A pending group never had its data
+ * synced, so its files must not go into place; instead we remove their
+ * temp files so that they aren't left behind. */
+void drop_finish_jobs(void)
+{
+	int j;
+
+	for (j = 0; j < finish_cnt; j++) {
+		if (finish_jobs[j].flags & FJ_FINISH && !inplace)
+			do_unlink(finish_jobs[j].fnametmp);
+	}
+	finish_cnt = 0;
+}
+
+static void add_finish_job(int ndx, int flags, mode_t mode, dev_t dev,
+			   char *fname, char *fnametmp)
+{
+	struct finish_job *fj;
+
+	if (finish_cnt && finish_jobs[finish_cnt-1].ndx == ndx
+	 && !(flags & FJ_FINISH)) {
+		finish_jobs[finish_cnt-1].flags |= flags;
+		return;
+	}
+
+	if (!finish_cnt)
+		finish_start = time(NULL);
+	fj = &finish_jobs[finish_cnt++];
+	fj->ndx = ndx;
+	fj->flags = flags;
+	fj->mode = mode;
+	fj->dev = dev;
+	if (flags & FJ_FINISH) {
+		int len = strlen(fname) + 1, len2 = strlen(fnametmp) + 1;
+		if (!(fj->fname = new_array(char, len + len2)))
+			out_of_memory("add_finish_job");
+		memcpy(fj->fname, fname, len);
+		fj->fnametmp = fj->fname + len;
+		memcpy(fj->fnametmp, fnametmp, len2);
+		finish_bytes += the_file_list->files[ndx]->length;
+	} else
+		fj->fname = fj->fnametmp = NULL;
+
+	if (finish_cnt == (remove_source_files ? FINISH_GROUP_RSF
+					       : FINISH_GROUP))
+		commit_finish_group("full");
+	else if (finish_bytes >= FINISH_GROUP_BYTES)
+		commit_finish_group("size");
+	else if (time(NULL) - finish_start >= FINISH_GROUP_SECS)
+		commit_finish_group("time");
+}
+
+/* With --async-finish we fork a helper that takes over each received file
+ * once its temp file is closed:  it sets the file's attributes, renames it
+ * into place (as part of a group, like above, for --fsync), and sends the
+ * file's MSG_SUCCESS or MSG_REDO, while we go on receiving the next file.
+ * All jobs go down one pipe and the helper does them in order, so the
+ * generator gets its messages in the same order as without the helper.  The
+ * helper's messages come back to us on a second pipe, with a MSG_DONE after
+ * each job, and we pass them on.  Every job is done before we tell the
+ * generator that phase 0 is over, and the redo phase doesn't use the
+ * helper at all. */
+#ifdef HAVE_SIGACTION
+static struct sigaction sigact;
+#endif
+static pid_t finisher_pid = -1;
+static int finisher_fd_out = -1, finisher_fd_in = -1;
+static int finisher_pending;
+static char finisher_buf[BIGPATHBUFLEN + 4];
+static int finisher_buf_cnt;
+
+struct finisher_hdr {
+	struct finish_job fj;
+	int len;
+};
+
+/* Returns 0 on EOF before any data, -1 on an error or a short read. */
+static int read_job_bytes(int fd, char *buf, int len)
+{
+	int n, got = 0;
+
+	while (got < len) {
+		if ((n = read(fd, buf + got, len - got)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			return got ? -1 : 0;
+		got += n;
+	}
+	return 1;
+}
+
+static int read_finisher_job(int fd)
+{
+	struct finisher_hdr hdr;
+	struct finish_job *fj = &finish_jobs[finish_cnt];
+	int ret;
+
+	if ((ret = read_job_bytes(fd, (char *)&hdr, sizeof hdr)) <= 0) {
+		if (ret < 0)
+			exit_cleanup(RERR_IPC);
+		return 0;
+	}
+	*fj = hdr.fj;
+	if (hdr.len) {
+		if (!(fj->fname = new_array(char, hdr.len)))
+			out_of_memory("read_finisher_job");
+		if (read_job_bytes(fd, fj->fname, hdr.len) <= 0)
+			exit_cleanup(RERR_IPC);
+		fj->fnametmp = fj->fname + strlen(fj->fname) + 1;
+	} else
+		fj->fname = fj->fnametmp = NULL;
+	finish_cnt++;
+
+	return 1;
+}
+
+static int job_is_waiting(int fd)
+{
+	struct timeval tv;
+	fd_set r_fds;
+
+	FD_ZERO(&r_fds);
+	FD_SET(fd, &r_fds);
+	tv.tv_sec = tv.tv_usec = 0;
+	return select(fd + 1, &r_fds, NULL, NULL, &tv) > 0;
+}
+
+/* The helper does whatever jobs have arrived as one group, and exits once
+ * the receiver closes the pipe. */
+static NORETURN void finisher_loop(int fd)
+{
+	int j, cnt, files;
+
+	while (read_finisher_job(fd)) {
+		while (finish_cnt < FINISH_GROUP && job_is_waiting(fd)
+		    && read_finisher_job(fd)) {}
+		cnt = finish_cnt;
+		files = commit_finish_jobs();
+		if (verbose > 2 && files) {
+			rprintf(FINFO, "finisher put %d file%s into place\n",
+				files, files == 1 ? "" : "s");
+		}
+		for (j = 0; j < cnt; j++)
+			send_msg(MSG_DONE, "", 0);
+		io_flush(FULL_FLUSH);
+	}
+	_exit(0);
+}
+
+static void start_finisher(int f_in)
+{
+	int jobs[2], msgs[2];
+
+	if (pipe(jobs) < 0) {
+		rsyserr(FERROR, errno, "pipe failed for --async-finish");
+		return;
+	}
+	if (pipe(msgs) < 0) {
+		rsyserr(FERROR, errno, "pipe failed for --async-finish");
+		close(jobs[0]);
+		close(jobs[1]);
+		return;
+	}
+
+	/* Don't let the helper inherit any queued messages. */
+	io_flush(FULL_FLUSH);
+
+	if ((finisher_pid = do_fork()) == -1) {
+		rsyserr(FERROR, errno, "fork failed for --async-finish");
+		close(jobs[0]);
+		close(jobs[1]);
+		close(msgs[0]);
+		close(msgs[1]);
+		return;
+	}
+
+	if (finisher_pid == 0) {
+		/* Finish every file we were handed, even if the transfer is
+		 * aborted:  each one was received in full. */
+		SIGACTION(SIGUSR1, SIG_IGN);
+		SIGACTION(SIGUSR2, SIG_IGN);
+		SIGACTION(SIGINT, SIG_IGN);
+		SIGACTION(SIGHUP, SIG_IGN);
+		SIGACTION(SIGTERM, SIG_IGN);
+		close(f_in);
+		close(jobs[1]);
+		close(msgs[0]);
+		/* This makes rwrite() hand every message to send_msg(). */
+		am_server = 1;
+		set_msg_fd_out(msgs[1]);
+		set_io_timeout(0);
+		finisher_loop(jobs[0]);
+	}
+
+	close(jobs[0]);
+	close(msgs[1]);
+	finisher_fd_out = jobs[1];
+	finisher_fd_in = msgs[0];
+	set_nonblocking(finisher_fd_out);
+	set_nonblocking(finisher_fd_in);
+
+	if (verbose > 2) {
+		rprintf(FINFO, "finisher starting pid=%ld\n",
+			(long)finisher_pid);
+	}
+}
+
+static NORETURN void finisher_died(void)
+{
+	int status;
+
+	rprintf(FERROR, "the --async-finish helper exited early [%s]\n",
+		who_am_i());
+	if (wait_process(finisher_pid, &status, 0) == finisher_pid
+	 && WIFEXITED(status) && WEXITSTATUS(status))
+		exit_cleanup(WEXITSTATUS(status));
+	exit_cleanup(RERR_IPC);
+}
+
+static void wait_for_finisher(int for_write)
+{
+	fd_set r_fds, w_fds;
+	int max_fd = MAX(finisher_fd_in, finisher_fd_out);
+
+	FD_ZERO(&r_fds);
+	FD_ZERO(&w_fds);
+	FD_SET(finisher_fd_in, &r_fds);
+	if (for_write)
+		FD_SET(finisher_fd_out, &w_fds);
+	io_wait_for_helper(max_fd, &r_fds, for_write ? &w_fds : NULL);
+}
+
+/* Pass on the messages the helper has sent us.  If wait is set, we keep
+ * at it until the helper has finished every job we gave it. */
+static void read_finisher_msgs(int wait)
+{
+	int n, tag, len;
+
+	while (1) {
+		n = read(finisher_fd_in, finisher_buf + finisher_buf_cnt,
+			 sizeof finisher_buf - finisher_buf_cnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EWOULDBLOCK && errno != EAGAIN)
+				finisher_died();
+			if (!wait || !finisher_pending)
+				return;
+			wait_for_finisher(0);
+			continue;
+		}
+		if (n == 0)
+			finisher_died();
+		finisher_buf_cnt += n;
+
+		while (finisher_buf_cnt >= 4) {
+			tag = IVAL(finisher_buf, 0);
+			len = tag & 0xFFFFFF;
+			tag = (tag >> 24) - MPLEX_BASE;
+			if (len > (int)sizeof finisher_buf - 4) {
+				rprintf(FERROR, "invalid message from the --async-finish helper [%s]\n",
+					who_am_i());
+				exit_cleanup(RERR_IPC);
+			}
+			if (finisher_buf_cnt < 4 + len)
+				break;
+			switch (tag) {
+			case MSG_DONE:
+				finisher_pending--;
+				break;
+			case MSG_SUCCESS:
+			case MSG_REDO:
+				send_msg((enum msgcode)tag, finisher_buf + 4, len);
+				break;
+			default:
+				rwrite((enum logcode)tag, finisher_buf + 4, len);
+				break;
+			}
+			finisher_buf_cnt -= 4 + len;
+			memmove(finisher_buf, finisher_buf + 4 + len,
+				finisher_buf_cnt);
+		}
+		if (wait && !finisher_pending)
+			return;
+	}
+}
+
+static void send_finisher_job(struct finish_job *fj)
+{
+	struct finisher_hdr hdr;
+	char buf[sizeof hdr + 2 * MAXPATHLEN], *bp = buf;
+	int len, n;
+
+	hdr.fj = *fj;
+	hdr.len = 0;
+	if (fj->flags & FJ_FINISH) {
+		len = strlcpy(buf + sizeof hdr, fj->fname, MAXPATHLEN) + 1;
+		hdr.len = len + strlcpy(buf + sizeof hdr + len, fj->fnametmp,
+					MAXPATHLEN) + 1;
+	}
+	memcpy(buf, &hdr, sizeof hdr);
+
+	/* The helper may be blocked sending us messages, so we read those
+	 * while we wait for room in the pipe. */
+	for (len = sizeof hdr + hdr.len; len > 0; ) {
+		if ((n = write(finisher_fd_out, bp, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EWOULDBLOCK && errno != EAGAIN)
+				finisher_died();
+			wait_for_finisher(1);
+			read_finisher_msgs(0);
+			continue;
+		}
+		bp += n;
+		len -= n;
+	}
+	finisher_pending++;
+}
+
+static void stop_finisher(void)
+{
+	int status;
+
+	if (finisher_pending)
+		read_finisher_msgs(1);
+	close(finisher_fd_out);
+	finisher_fd_out = -1;
+	wait_process(finisher_pid, &status, 0);
+	close(finisher_fd_in);
+	finisher_fd_in = -1;
+}
+
+static void finish_file(int ndx, int flags, struct file_struct *file,
+			dev_t dev, char *fname, char *fnametmp)
+{
+	struct finish_job fj;
+
+	if (do_fsync && finisher_fd_out < 0) {
+		add_finish_job(ndx, flags, file->mode, dev, fname, fnametmp);
+		return;
+	}
+
+	fj.ndx = ndx;
+	fj.flags = flags;
+	fj.mode = file->mode;
+	fj.dev = dev;
+	fj.fname = fname;
+	fj.fnametmp = fnametmp;
+	if (finisher_fd_out >= 0)
+		send_finisher_job(&fj);
+	else
+		run_finish_job(&fj);
+}
+
+static void finish_msg(int ndx, int flags)
+{
+	struct finish_job fj;
+
+	if (finish_cnt) {
+		add_finish_job(ndx, flags, 0, 0, NULL, NULL);
+		return;
+	}
+
+	fj.ndx = ndx;
+	fj.flags = flags;
+	if (finisher_pending)
+		send_finisher_job(&fj);
+	else
+		send_finish_msgs(&fj);
+}
+
 static void handle_delayed_updates(struct file_list *flist, char *local_name)
 {
 	char *fname, *partialptr, numbuf[4];
 	int i;
 
+	if (do_fsync)
+		sync_delayed_files(flist, local_name);
+
 	for (i = -1; (i = bitbag_next_bit(delayed_bits, i)) >= 0; ) {
 		struct file_struct *file = flist->files[i];
 		fname = local_name ? local_name : f_name(file, NULL);
@@ -309,6 +934,8 @@ static void handle_delayed_updates(struct file_list *flist, char *local_name)
 					"rename failed for %s (from %s)",
 					full_fname(fname), partialptr);
 			} else {
+				if (do_fsync)
+					note_renamed_file(fname);
 				if (remove_source_files
 				    || (preserve_hard_links
 				     && file->link_u.links)) {
@@ -319,6 +946,8 @@ static void handle_delayed_updates(struct file_list *flist, char *local_name)
 			}
 		}
 	}
+	if (do_fsync)
+		sync_renamed_dir();
 }
 
 static int get_next_gen_i(int batch_gen_fd, int next_gen_i, int desired_i)
@@ -351,7 +980,7 @@ int recv_files(int f_in, struct file_list *flist, char *local_name)
 	char *fname, fbuf[MAXPATHLEN];
 	char xname[MAXPATHLEN];
 	char fnametmp[MAXPATHLEN];
-	char *fnamecmp, *partialptr, numbuf[4];
+	char *fnamecmp, *partialptr;
 	char fnamecmpbuf[MAXPATHLEN];
 	uchar fnamecmp_type;
 	struct file_struct *file;
@@ -360,7 +989,8 @@ int recv_files(int f_in, struct file_list *flist, char *local_name)
 	int itemizing = am_server ? logfile_format_has_i : stdout_format_has_i;
 	enum logcode log_code = log_before_transfer ? FLOG : FINFO;
 	int max_phase = protocol_version >= 29 ? 2 : 1;
-	int i, recv_ok;
+	int i, recv_ok, finishing, unnamed;
+	dev_t dev = 0;
 
 	if (verbose > 2)
 		rprintf(FINFO,"recv_files(%d) starting\n",flist->count);
@@ -375,11 +1005,35 @@ int recv_files(int f_in, struct file_list *flist, char *local_name)
 
 	updating_basis = inplace;
 
+	if (async_finish && do_xfers && !inplace
+#ifdef HAVE_COPYFILE
+	 && !extended_attributes
+#endif
+	 && write_batch >= 0)
+		start_finisher(f_in);
+
 	while (1) {
 		cleanup_disable();
 
+		if (finisher_pending)
+			read_finisher_msgs(0);
+
 		i = read_int(f_in);
+		if (inc_recurse && (i == NDX_FLIST_DIR || i == NDX_FLIST_EOF)) {
+			/* The generator needs to see the same sub-lists. */
+			io_start_flist_forward(i);
+			if (i == NDX_FLIST_DIR) {
+				int dir_ndx = read_int(f_in);
+				recv_sub_list(f_in, flist, dir_ndx);
+			}
+			io_end_flist_forward();
+			continue;
+		}
 		if (i == -1) {
+			if (finisher_fd_out >= 0)
+				stop_finisher();
+			if (finish_cnt)
+				commit_finish_group("end of phase");
 			if (read_batch) {
 				get_next_gen_i(batch_gen_fd, next_gen_i,
 					       flist->count);
@@ -585,6 +1239,13 @@ int recv_files(int f_in, struct file_list *flist, char *local_name)
 			fd1 = -1;
 		}
 
+#ifdef HAVE_POSIX_FADVISE
+		/* The sender's matches mostly walk the basis file in order, so
+		 * have the kernel read ahead while we wait on the socket. */
+		if (fd1 != -1)
+			posix_fadvise(fd1, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
 		/* If we're not preserving permissions, change the file-list's
 		 * mode based on the local permissions and some heuristics. */
 		if (!preserve_perms) {
@@ -617,7 +1278,9 @@ int recv_files(int f_in, struct file_list *flist, char *local_name)
 			 * the lchown. Thanks to snabb@epipe.fi for pointing
 			 * this out.  We also set it initially without group
 			 * access because of a similar race condition. */
-			fd2 = do_mkstemp(fnametmp, file->mode & INITACCESSPERMS);
+			fd2 = do_open_tmpfile(fnametmp, file->mode & INITACCESSPERMS);
+			if (fd2 == -1)
+				fd2 = do_mkstemp(fnametmp, file->mode & INITACCESSPERMS);
 
 			/* in most cases parent directories will already exist
 			 * because their information should have been previously
@@ -668,37 +1331,69 @@ int recv_files(int f_in, struct file_list *flist, char *local_name)
 
 		if (fd1 != -1)
 			close(fd1);
+
+		/* An unnamed temp file only gets a name if we're keeping it;
+		 * one we discard just goes away when it is closed. */
+		finishing = (recv_ok && (!delay_updates || !partialptr)) || inplace;
+		if (finishing || (keep_partial && partialptr)) {
+			if (do_link_tmpfile(fd2, fnametmp) < 0) {
+				rsyserr(FERROR, errno,
+					"unable to link temp file for %s",
+					full_fname(fname));
+				close(fd2);
+				cleanup_disable();
+				continue;
+			}
+			unnamed = 0;
+		} else if ((unnamed = tmpfile_is_unnamed(fd2)) != 0)
+			forget_tmpfile(fd2);
+
+		/* If the file is going into place, set its attributes through
+		 * the still-open fd rather than by name (unless the helper is
+		 * going to finish it). */
+		if (finishing && finisher_fd_out < 0) {
+			set_file_attrs_fd(inplace ? fname : fnametmp, fd2, file,
+					  NULL, recv_ok ? 0 : ATTRS_SKIP_MTIME);
+		}
+
+		/* A finished file is synced with the rest of its group in
+		 * commit_finish_jobs(), and one for --delay-updates in
+		 * handle_delayed_updates(). */
+		if (do_fsync && finishing)
+			dev = start_writeback(fd2);
+		else if (do_fsync && !delay_updates && fsync(fd2) < 0) {
+			rsyserr(FERROR, errno, "fsync failed on %s",
+				full_fname(fnametmp));
+			exit_cleanup(RERR_FILEIO);
+		}
+
 		if (close(fd2) < 0) {
 			rsyserr(FERROR, errno, "close failed on %s",
 				full_fname(fnametmp));
 			exit_cleanup(RERR_FILEIO);
 		}
 
-		if ((recv_ok && (!delay_updates || !partialptr)) || inplace) {
-			char *temp_copy_name;
-			if (partialptr == fname)
-				partialptr = temp_copy_name = NULL;
-			else if (*partial_dir == '/')
-				temp_copy_name = NULL;
-			else
-				temp_copy_name = partialptr;
-			finish_transfer(fname, fnametmp, temp_copy_name,
-					file, recv_ok, 1);
-			if (fnamecmp == partialptr) {
-				do_unlink(partialptr);
-				handle_partial_dir(partialptr, PDIR_DELETE);
-			}
+		if (finishing) {
+			int flags = FJ_FINISH;
+			if (finisher_fd_out < 0)
+				flags |= FJ_ATTRS_SET;
+			if (recv_ok)
+				flags |= FJ_RECV_OK;
+			if (partialptr != fname && fnamecmp == partialptr)
+				flags |= FJ_DEL_PARTIAL;
+			finish_file(i, flags, file, dev, fname, fnametmp);
 		} else if (keep_partial && partialptr
 		    && handle_partial_dir(partialptr, PDIR_CREATE)) {
 			finish_transfer(partialptr, fnametmp, NULL,
-					file, recv_ok, !partial_dir);
+					file, recv_ok, !partial_dir, 0);
 			if (delay_updates && recv_ok) {
 				bitbag_set_bit(delayed_bits, i);
 				recv_ok = -1;
 			}
 		} else {
 			partialptr = NULL;
-			do_unlink(fnametmp);
+			if (!unnamed)
+				do_unlink(fnametmp);
 		}
 #ifdef HAVE_COPYFILE
 		if (extended_attributes && (file->flags & FLAG_CLEAR_METADATA)) {
@@ -715,10 +1410,8 @@ int recv_files(int f_in, struct file_list *flist, char *local_name)
 
 		if (recv_ok > 0) {
 			if (remove_source_files
-			    || (preserve_hard_links && file->link_u.links)) {
-				SIVAL(numbuf, 0, i);
-				send_msg(MSG_SUCCESS, numbuf, 4);
-			}
+			    || (preserve_hard_links && file->link_u.links))
+				finish_msg(i, FJ_SUCCESS);
 		} else if (!recv_ok) {
 			int msgtype = phase || read_batch ? FERROR : FINFO;
 			if (msgtype == FERROR || verbose) {
@@ -740,16 +1433,16 @@ int recv_files(int f_in, struct file_list *flist, char *local_name)
 					"%s: %s failed verification -- update %s%s.\n",
 					errstr, fname, keptstr, redostr);
 			}
-			if (!phase) {
-				SIVAL(numbuf, 0, i);
-				send_msg(MSG_REDO, numbuf, 4);
-			}
+			if (!phase)
+				finish_msg(i, FJ_REDO);
 		}
 	}
 	make_backups = save_make_backups;
 
 	if (phase == 2 && delay_updates) /* for protocol_version < 29 */
 		handle_delayed_updates(flist, local_name);
+	if (do_fsync)
+		sync_renamed_dir();
 
 	if (verbose > 2)
 		rprintf(FINFO,"recv_files finished\n");
@@ -125,16 +125,38 @@ mode_t dest_mode(mode_t flist_mode, mode_t stat_mode, int exists)
 
 int set_file_attrs(char *fname, struct file_struct *file, STRUCT_STAT *st,
 		   int flags)
+{
+	return set_file_attrs_fd(fname, -1, file, st, flags);
+}
+
+/* This is set_file_attrs() for a regular file that we still have open as
+ * fd (or -1 if we don't), which lets us avoid a path lookup for each of
+ * the stat, chown, chmod, and time-setting calls. */
+int set_file_attrs_fd(char *fname, int fd, struct file_struct *file,
+		      STRUCT_STAT *st, int flags)
 {
 	int updated = 0;
 	STRUCT_STAT st2;
 	int change_uid, change_gid;
 	mode_t new_mode = file->mode;
+#ifdef SUPPORT_ATTRS_AT
+	int dfd = -1;
+	char *name;
+#endif
 
 	if (!st) {
+		int ret;
 		if (dry_run)
 			return 1;
-		if (link_stat(fname, &st2, 0) < 0) {
+		if (fd >= 0)
+			ret = do_fstat(fd, &st2);
+#ifdef SUPPORT_ATTRS_AT
+		else if ((name = attrs_dir_name(fname, &dfd)) != NULL)
+			ret = do_lstat_at(dfd, name, &st2);
+#endif
+		else
+			ret = link_stat(fname, &st2, 0);
+		if (ret < 0) {
 			rsyserr(FERROR, errno, "stat %s failed",
 				full_fname(fname));
 			return 0;
@@ -152,7 +174,17 @@ int set_file_attrs(char *fname, struct file_struct *file, STRUCT_STAT *st,
 		flags |= ATTRS_SKIP_MTIME;
 	if (!(flags & ATTRS_SKIP_MTIME)
 	    && cmp_time(st->st_mtime, file->modtime) != 0) {
-		int ret = set_modtime(fname, file->modtime, st->st_mode);
+		int ret;
+		if (fd >= 0)
+			ret = set_modtime_fd(fd, fname, file->modtime);
+#ifdef SUPPORT_ATTRS_AT
+		else if ((name = attrs_dir_name(fname, &dfd)) != NULL) {
+			ret = set_modtime_at(dfd, name, fname, file->modtime,
+					     st->st_mode);
+		}
+#endif
+		else
+			ret = set_modtime(fname, file->modtime, st->st_mode);
 		if (ret < 0) {
 			rsyserr(FERROR, errno, "failed to set times on %s",
 				full_fname(fname));
@@ -171,6 +203,9 @@ int set_file_attrs(char *fname, struct file_struct *file, STRUCT_STAT *st,
 	else
 #endif
 	if (change_uid || change_gid) {
+		uid_t uid = change_uid ? file->uid : st->st_uid;
+		gid_t gid = change_gid ? file->gid : st->st_gid;
+		int ret;
 		if (verbose > 2) {
 			if (change_uid) {
 				rprintf(FINFO,
@@ -185,9 +220,18 @@ int set_file_attrs(char *fname, struct file_struct *file, STRUCT_STAT *st,
 					(long)st->st_gid, (long)file->gid);
 			}
 		}
-		if (do_lchown(fname,
-		    change_uid ? file->uid : st->st_uid,
-		    change_gid ? file->gid : st->st_gid) != 0) {
+#ifdef HAVE_FCHOWN
+		if (fd >= 0)
+			ret = do_fchown(fd, uid, gid);
+		else
+#endif
+#ifdef SUPPORT_ATTRS_AT
+		if ((name = attrs_dir_name(fname, &dfd)) != NULL)
+			ret = do_lchown_at(dfd, name, uid, gid);
+		else
+#endif
+			ret = do_lchown(fname, uid, gid);
+		if (ret != 0) {
 			/* shouldn't have attempted to change uid or gid
 			 * unless have the privilege */
 			rsyserr(FERROR, errno, "%s %s failed",
@@ -199,8 +243,12 @@ int set_file_attrs(char *fname, struct file_struct *file, STRUCT_STAT *st,
 		 * destination had the setuid or setgid bits set due
 		 * to the side effect of the chown call */
 		if (st->st_mode & (S_ISUID | S_ISGID)) {
-			link_stat(fname, st,
-				  keep_dirlinks && S_ISDIR(st->st_mode));
+			if (fd >= 0)
+				do_fstat(fd, st);
+			else {
+				link_stat(fname, st,
+					  keep_dirlinks && S_ISDIR(st->st_mode));
+			}
 		}
 		updated = 1;
 	}
@@ -209,7 +257,19 @@ int set_file_attrs(char *fname, struct file_struct *file, STRUCT_STAT *st,
 		new_mode = tweak_mode(new_mode, daemon_chmod_modes);
 #ifdef HAVE_CHMOD
 	if ((st->st_mode & CHMOD_BITS) != (new_mode & CHMOD_BITS)) {
-		int ret = do_chmod(fname, new_mode);
+		int ret;
+#ifdef HAVE_FCHMOD
+		if (fd >= 0)
+			ret = do_fchmod(fd, new_mode);
+		else
+#endif
+#ifdef SUPPORT_ATTRS_AT
+		if (!S_ISLNK(new_mode)
+		 && (name = attrs_dir_name(fname, &dfd)) != NULL)
+			ret = do_chmod_at(dfd, name, new_mode);
+		else
+#endif
+			ret = do_chmod(fname, new_mode);
 		if (ret < 0) {
 			rsyserr(FERROR, errno,
 				"failed to set permissions on %s",
@@ -247,10 +307,12 @@ RETSIGTYPE sig_int(UNUSED(int val))
 /* Finish off a file transfer: renaming the file and setting the file's
  * attributes (e.g. permissions, ownership, etc.).  If partialptr is not
  * NULL and the robust_rename() call is forced to copy the temp file, we
- * stage the file into the partial-dir and then rename it into place. */
+ * stage the file into the partial-dir and then rename it into place.
+ * If attrs_set is non-zero, the caller already set fnametmp's attributes
+ * (through its open fd), so we only need to redo that after a copy. */
 void finish_transfer(char *fname, char *fnametmp, char *partialptr,
 		     struct file_struct *file, int ok_to_set_time,
-		     int overwriting_basis)
+		     int overwriting_basis, int attrs_set)
 {
 	int ret;
 
@@ -265,8 +327,10 @@ void finish_transfer(char *fname, char *fnametmp, char *partialptr,
 		return;
 
 	/* Change permissions before putting the file into place. */
-	set_file_attrs(fnametmp, file, NULL,
-		       ok_to_set_time ? 0 : ATTRS_SKIP_MTIME);
+	if (!attrs_set) {
+		set_file_attrs(fnametmp, file, NULL,
+			       ok_to_set_time ? 0 : ATTRS_SKIP_MTIME);
+	}
 
 	/* move tmp file over real file */
 	if (verbose > 2)
@@ -289,8 +353,10 @@ void finish_transfer(char *fname, char *fnametmp, char *partialptr,
 	fnametmp = partialptr ? partialptr : fname;
 
   do_set_file_attrs:
-	set_file_attrs(fnametmp, file, NULL,
-		       ok_to_set_time ? 0 : ATTRS_SKIP_MTIME);
+	if (!inplace || !attrs_set) {
+		set_file_attrs(fnametmp, file, NULL,
+			       ok_to_set_time ? 0 : ATTRS_SKIP_MTIME);
+	}
 
 	if (partialptr) {
 		if (do_rename(fnametmp, fname) < 0) {
@@ -70,6 +70,15 @@
 #define FLAG_MISSING (1<<6)	/* generator */
 #define FLAG_CLEAR_METADATA (1<<7) /* receiver */
 
+/* With --inc-recursive, the sender starts each directory's sub-list with
+ * NDX_FLIST_DIR where a file index would go, and ends them all with
+ * NDX_FLIST_EOF.  Both are below the -1 that ends a phase.  The generator
+ * sends NDX_FLIST_DIR back to the sender as each sub-list is used, and the
+ * sender keeps no more than MAX_SUB_LISTS_AHEAD of them unused. */
+#define NDX_FLIST_DIR (-2)
+#define NDX_FLIST_EOF (-3)
+#define MAX_SUB_LISTS_AHEAD 8
+
 /* update this if you make incompatible changes */
 #define PROTOCOL_VERSION 29
 
@@ -101,6 +110,9 @@
 #define CHUNK_SIZE (32*1024)
 #define MAX_MAP_SIZE (256*1024)
 #define IO_BUFFER_SIZE (4092)
+#define MAX_IO_BUFFER_SIZE (256*1024)
+#define MAX_SOCKBUF_SIZE (16*1024*1024)
+#define FILESFROM_BUFSIZE (32*1024)
 #define MAX_BLOCK_SIZE ((int32)1 << 29)
 
 #define IOERR_GENERAL	(1<<0) /* For backward compatibility, this must == 1 */
@@ -149,6 +161,7 @@
 #define ITEM_REPORT_GROUP (1<<6)
 #define ITEM_REPORT_ACL (1<<7)
 #define ITEM_REPORT_XATTR (1<<8)
+#define ITEM_SENT_WHOLE (1<<9)
 #define ITEM_BASIS_TYPE_FOLLOWS (1<<11)
 #define ITEM_XNAME_FOLLOWS (1<<12)
 #define ITEM_IS_NEW (1<<13)
@@ -174,6 +187,7 @@ enum msgcode {
 	MSG_ERROR=FERROR, MSG_INFO=FINFO, /* remote logging */
 	MSG_LOG=FLOG, MSG_SOCKERR=FSOCKERR, /* sibling logging */
 	MSG_REDO=9,	/* reprocess indicated flist index */
+	MSG_FLIST=20,	/* receiver passes an --inc-recursive sub-list on */
 	MSG_SUCCESS=100,/* successfully updated indicated flist index */
 	MSG_DELETED=101,/* successfully deleted a file on receiving side */
 	MSG_DONE=86	/* current phase is done */
@@ -272,6 +286,10 @@ enum msgcode {
 #include <sys/select.h>
 #endif
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 #ifdef HAVE_SYS_MODE_H
 /* apparently AIX needs this for S_ISLNK */
 #ifndef S_ISLNK
@@ -559,10 +577,21 @@ struct file_struct {
 #define WITH_HLINK	1
 #define WITHOUT_HLINK	0
 
+/* An interned directory name (see intern_dirname() in flist.c). */
+struct dirname_entry {
+	char *name;
+	int len;
+	int depth;
+};
+
 struct file_list {
 	struct file_struct **files;
 	alloc_pool_t file_pool;
 	alloc_pool_t hlink_pool;
+	struct dirname_entry *dirnames;	/* hash table of interned dirnames */
+	int dirnames_size, dirnames_cnt;
+	int32 *name_index;	/* optional index for flist_find() (+1'd) */
+	int name_index_size;
 	int count;
 	int malloced;
 	int low, high;
@@ -712,6 +741,17 @@ extern int errno;
 #ifdef HAVE_LINK
 #define SUPPORT_HARD_LINKS 1
 #endif
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H && defined HAVE_FTRUNCATE
+#define SUPPORT_FLIST_SPILL 1
+#endif
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H && defined HAVE_FCHDIR
+#define SUPPORT_FLIST_SNAPSHOT 1
+#define SNAPSHOT_MISS (-2)
+#endif
+#if defined HAVE_FSTATAT && defined HAVE_FCHMODAT && defined HAVE_FCHOWNAT \
+ && defined HAVE_UTIMENSAT
+#define SUPPORT_ATTRS_AT 1
+#endif
 
 #ifdef HAVE_SIGACTION
 #define SIGACTION(n,h) sigact.sa_handler=(h), sigaction((n),&sigact,NULL)
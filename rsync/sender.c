@@ -46,6 +46,9 @@ extern int inplace;
 extern int batch_fd;
 extern int write_batch;
 extern int no_cache;
+extern int send_ahead;
+extern int inc_recurse;
+extern char *logfile_name;
 extern struct stats stats;
 extern struct file_list *the_file_list;
 extern char *stdout_format;
@@ -180,8 +183,10 @@ int read_item_attrs(int f_in, int f_out, int ndx, uchar *type_ptr,
 	int iflags = protocol_version >= 29 ? read_shortint(f_in)
 		   : ITEM_TRANSFER | ITEM_MISSING_DATA;
 
-	/* Handle the new keep-alive (no-op) packet. */
-	if (ndx == the_file_list->count && iflags == ITEM_IS_NEW)
+	/* Handle the new keep-alive (no-op) packet.  With --inc-recursive,
+	 * the generator's count can be behind ours. */
+	if (iflags == ITEM_IS_NEW && (ndx == the_file_list->count
+	    || (inc_recurse && ndx >= 0 && ndx < the_file_list->count)))
 		;
 	else if (ndx < 0 || ndx >= the_file_list->count) {
 		rprintf(FERROR, "Invalid file index: %d (count=%d) [%s]\n",
@@ -221,6 +226,513 @@ int read_item_attrs(int f_in, int f_out, int ndx, uchar *type_ptr,
 	return iflags;
 }
 
+/* With --send-ahead=NUM we fork NUM helpers and give each file transfer
+ * request to the next one in turn.  A helper opens and maps the file and
+ * runs match_sums() into a pipe, while we send the output of the oldest
+ * request on to the receiver, so the reads and delta searches of up to
+ * NUM files overlap.  A helper's output is multiplexed just like our own
+ * socket:  MSG_DATA for the file's data and the usual messages, plus a
+ * MSG_SUCCESS once the file is open and a MSG_DONE when it's finished.
+ * Everything goes out in the order the generator asked for it, so the
+ * receiver sees the same stream it would without the helpers.  We only
+ * read a new request when one is waiting, and never in the middle of a
+ * file's data, so a keep-alive can't land inside a file. */
+#ifdef HAVE_SIGACTION
+static struct sigaction sigact;
+#endif
+
+#define AHEAD_MAX_HELPERS 32
+#define AHEAD_QUEUE 256
+#define AHEAD_BUF_MAX (4*1024*1024)
+
+struct ahead_helper {
+	pid_t pid;
+	int job_fd, out_fd;
+	char *buf;
+	int buf_pos, buf_cnt, buf_size;
+};
+
+struct ahead_req {
+	int ndx, iflags, xlen, helper;
+	uchar fnamecmp_type;
+	char *xname;
+	struct sum_struct *s; /* NULL if we just pass the request on */
+};
+
+struct ahead_job {
+	int32 ndx;
+	int updating_basis, has_sums, name_len;
+	struct sum_struct s;
+};
+
+struct ahead_done {
+	int ok, io_error;
+	int64 literal_data, matched_data;
+	int totals[3];
+};
+
+static struct ahead_helper *ahead_helpers;
+static int ahead_helper_cnt, ahead_next_helper;
+static struct ahead_req ahead_queue[AHEAD_QUEUE];
+static int ahead_head, ahead_cnt, ahead_jobs;
+static int ahead_started; /* the oldest file's data is being sent */
+static int ahead_out_fd = -1; /* a helper's multiplexed output */
+static int ahead_helper_num; /* which helper we are, in a helper */
+static struct stats ahead_initial_stats;
+
+static int read_ahead_bytes(int fd, char *buf, int len)
+{
+	int n, got = 0;
+
+	while (got < len) {
+		if ((n = read(fd, buf + got, len - got)) < 0) {
+			if (errno == EINTR)
+				continue;
+			exit_cleanup(RERR_IPC);
+		}
+		if (n == 0) {
+			if (got)
+				exit_cleanup(RERR_IPC);
+			return 0;
+		}
+		got += n;
+	}
+	return 1;
+}
+
+static void write_ahead_bytes(int fd, char *buf, int len)
+{
+	int n;
+
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			rsyserr(FERROR, errno, "write to --send-ahead helper failed");
+			exit_cleanup(RERR_IPC);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/* This runs in a helper, and does what send_files() would do for one file
+ * after reading its checksums. */
+static void send_ahead_file(char *fname, struct sum_struct *s)
+{
+	struct map_struct *mbuf;
+	struct ahead_done done;
+	STRUCT_STAT st;
+	int fd, j, totals[3];
+
+	memset(&done, 0, sizeof done);
+	io_error = 0;
+	done.literal_data = stats.literal_data;
+	done.matched_data = stats.matched_data;
+	get_match_totals(totals);
+
+	fd = do_open(fname, O_RDONLY, 0);
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			enum logcode c = am_daemon
+			    && protocol_version < 28 ? FERROR
+						     : FINFO;
+			io_error |= IOERR_VANISHED;
+			rprintf(c, "file has vanished: %s\n",
+				full_fname(fname));
+		} else {
+			io_error |= IOERR_GENERAL;
+			rsyserr(FERROR, errno,
+				"send_files failed to open %s",
+				full_fname(fname));
+		}
+		goto finished;
+	}
+#ifdef F_NOCACHE
+	if (no_cache)
+		fcntl(fd, F_NOCACHE, 1);
+#endif		/* F_NOCACHE */
+	if (do_fstat(fd, &st) != 0) {
+		io_error |= IOERR_GENERAL;
+		rsyserr(FERROR, errno, "fstat failed");
+		close(fd);
+		goto finished;
+	}
+
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	if (st.st_size) {
+		int32 read_size = MAX(s->blength * 3, MAX_MAP_SIZE);
+		mbuf = map_file(fd, st.st_size, read_size, s->blength);
+	} else
+		mbuf = NULL;
+
+	if (verbose > 2) {
+		rprintf(FINFO, "send_files mapped %s of size %.0f\n",
+			fname, (double)st.st_size);
+	}
+
+	/* Tell the parent to send the file's index and checksum header. */
+	io_multiplex_write(MSG_SUCCESS, "", 0);
+
+	if (verbose > 2)
+		rprintf(FINFO, "calling match_sums %s\n", fname);
+
+	set_compression(fname);
+
+	match_sums(ahead_out_fd, s, mbuf, st.st_size);
+
+	if (mbuf) {
+		j = unmap_file(mbuf);
+		if (j) {
+			io_error |= IOERR_GENERAL;
+			rsyserr(FERROR, j,
+				"read errors mapping %s",
+				full_fname(fname));
+		}
+	}
+	close(fd);
+
+	if (verbose > 2) {
+		rprintf(FINFO, "send-ahead helper %d finished %s\n",
+			ahead_helper_num, fname);
+	}
+
+	done.ok = 1;
+
+  finished:
+	done.io_error = io_error;
+	done.literal_data = stats.literal_data - done.literal_data;
+	done.matched_data = stats.matched_data - done.matched_data;
+	get_match_totals(done.totals);
+	for (j = 0; j < 3; j++)
+		done.totals[j] -= totals[j];
+	io_multiplex_write(MSG_DONE, (char *)&done, sizeof done);
+	io_flush(FULL_FLUSH);
+}
+
+static NORETURN void send_ahead_loop(int job_fd)
+{
+	struct ahead_job job;
+	char fname[MAXPATHLEN];
+
+	while (read_ahead_bytes(job_fd, (char *)&job, sizeof job)) {
+		struct sum_struct *s = &job.s;
+		if (job.has_sums) {
+			if (!(s->sums = new_array(struct sum_buf, s->count)))
+				out_of_memory("send_ahead_loop");
+			read_ahead_bytes(job_fd, (char *)s->sums,
+					 s->count * sizeof s->sums[0]);
+		} else
+			s->sums = NULL;
+		if (job.name_len >= MAXPATHLEN
+		 || !read_ahead_bytes(job_fd, fname, job.name_len))
+			exit_cleanup(RERR_IPC);
+		fname[job.name_len] = '\0';
+		updating_basis_file = job.updating_basis;
+		send_ahead_file(fname, s);
+		if (s->sums)
+			free(s->sums);
+	}
+	_exit(0);
+}
+
+static void start_send_ahead(int f_in, int f_out)
+{
+	struct ahead_helper *h;
+	int jobs[2], out[2], j;
+
+	if (send_ahead > AHEAD_MAX_HELPERS)
+		send_ahead = AHEAD_MAX_HELPERS;
+	if (!(ahead_helpers = new_array(struct ahead_helper, send_ahead)))
+		out_of_memory("start_send_ahead");
+
+	/* Don't let the helpers inherit any buffered output. */
+	io_flush(FULL_FLUSH);
+
+	for (j = 0; j < send_ahead; j++) {
+		h = &ahead_helpers[j];
+		if (pipe(jobs) < 0 || pipe(out) < 0) {
+			rsyserr(FERROR, errno, "pipe failed for --send-ahead");
+			exit_cleanup(RERR_IPC);
+		}
+		if ((h->pid = do_fork()) == -1) {
+			rsyserr(FERROR, errno, "fork failed for --send-ahead");
+			exit_cleanup(RERR_IPC);
+		}
+		if (h->pid == 0) {
+			int k;
+			/* Die quietly if the transfer is aborted. */
+			SIGACTION(SIGUSR1, SIG_DFL);
+			SIGACTION(SIGUSR2, SIG_DFL);
+			SIGACTION(SIGINT, SIG_DFL);
+			SIGACTION(SIGHUP, SIG_DFL);
+			SIGACTION(SIGTERM, SIG_DFL);
+			for (k = 0; k < j; k++) {
+				close(ahead_helpers[k].job_fd);
+				close(ahead_helpers[k].out_fd);
+			}
+			close(jobs[1]);
+			close(out[0]);
+			close(f_in);
+			if (f_out != f_in)
+				close(f_out);
+			/* Our messages go to the parent in our multiplexed
+			 * output.  A server's rwrite() logs a message before
+			 * it passes it on, but a client's gets logged when
+			 * the parent prints it, so we must not log it too. */
+			if (!am_server) {
+				logfile_name = NULL;
+				am_server = 1;
+			}
+			set_msg_fd_in(-1);
+			set_io_timeout(0);
+			ahead_out_fd = out[1];
+			ahead_helper_num = j;
+			io_set_sock_fds(-1, ahead_out_fd);
+			io_start_multiplex_out();
+			send_ahead_loop(jobs[0]);
+		}
+		close(jobs[0]);
+		close(out[1]);
+		h->job_fd = jobs[1];
+		h->out_fd = out[0];
+		set_nonblocking(h->out_fd);
+		h->buf = NULL;
+		h->buf_pos = h->buf_cnt = h->buf_size = 0;
+	}
+	ahead_helper_cnt = send_ahead;
+
+	if (verbose > 2)
+		rprintf(FINFO, "send-ahead started %d helpers\n", send_ahead);
+}
+
+static void stop_send_ahead(void)
+{
+	int j, status;
+
+	for (j = 0; j < ahead_helper_cnt; j++) {
+		struct ahead_helper *h = &ahead_helpers[j];
+		close(h->job_fd);
+		wait_process(h->pid, &status, 0);
+		close(h->out_fd);
+		if (h->buf)
+			free(h->buf);
+	}
+	free(ahead_helpers);
+	ahead_helpers = NULL;
+	ahead_helper_cnt = 0;
+}
+
+static void queue_ahead(int ndx, int iflags, uchar fnamecmp_type,
+			char *xname, int xlen, struct sum_struct *s,
+			char *fname)
+{
+	struct ahead_req *req;
+
+	req = &ahead_queue[(ahead_head + ahead_cnt++) % AHEAD_QUEUE];
+	req->ndx = ndx;
+	req->iflags = iflags;
+	req->fnamecmp_type = fnamecmp_type;
+	req->xlen = xlen;
+	if (xlen < 0)
+		req->xname = NULL;
+	else if (!(req->xname = new_array(char, xlen + 1)))
+		out_of_memory("queue_ahead");
+	else
+		memcpy(req->xname, xname, xlen + 1);
+	req->s = s;
+
+	if (s) {
+		struct ahead_job job;
+		struct ahead_helper *h = &ahead_helpers[ahead_next_helper];
+		req->helper = ahead_next_helper;
+		ahead_next_helper = (ahead_next_helper + 1) % ahead_helper_cnt;
+		ahead_jobs++;
+		memset(&job, 0, sizeof job);
+		job.ndx = ndx;
+		job.updating_basis = updating_basis_file;
+		job.has_sums = s->sums != NULL;
+		job.name_len = strlen(fname);
+		job.s = *s;
+		write_ahead_bytes(h->job_fd, (char *)&job, sizeof job);
+		if (s->sums) {
+			write_ahead_bytes(h->job_fd, (char *)s->sums,
+					  s->count * sizeof s->sums[0]);
+		}
+		write_ahead_bytes(h->job_fd, fname, job.name_len);
+	}
+}
+
+/* Wait for more output from the helper we need, and read whatever the
+ * others have ready while we're at it.  If f_in isn't -1, we also return
+ * once a new request arrives. */
+static void fill_ahead_bufs(struct ahead_helper *wait_for, int f_in)
+{
+	struct ahead_helper *h;
+	fd_set r_fds;
+	int j, n, max_fd = f_in;
+
+	FD_ZERO(&r_fds);
+	if (f_in >= 0)
+		FD_SET(f_in, &r_fds);
+	for (j = 0; j < ahead_helper_cnt; j++) {
+		h = &ahead_helpers[j];
+		if (h->buf_cnt < AHEAD_BUF_MAX || h == wait_for) {
+			FD_SET(h->out_fd, &r_fds);
+			if (h->out_fd > max_fd)
+				max_fd = h->out_fd;
+		}
+	}
+	if (io_wait_for_helper(max_fd, &r_fds, NULL) <= 0)
+		return;
+
+	for (j = 0; j < ahead_helper_cnt; j++) {
+		h = &ahead_helpers[j];
+		if (!FD_ISSET(h->out_fd, &r_fds))
+			continue;
+		if (h->buf_pos
+		 && h->buf_size - h->buf_pos - h->buf_cnt < IO_BUFFER_SIZE) {
+			memmove(h->buf, h->buf + h->buf_pos, h->buf_cnt);
+			h->buf_pos = 0;
+		}
+		if (h->buf_size - h->buf_cnt < IO_BUFFER_SIZE) {
+			h->buf_size = h->buf_cnt + 4 * IO_BUFFER_SIZE;
+			if (!(h->buf = realloc_array(h->buf, char, h->buf_size)))
+				out_of_memory("fill_ahead_bufs");
+		}
+		n = read(h->out_fd, h->buf + h->buf_pos + h->buf_cnt,
+			 h->buf_size - h->buf_pos - h->buf_cnt);
+		if (n > 0)
+			h->buf_cnt += n;
+		else if (n == 0 || (errno != EINTR && errno != EAGAIN
+				    && errno != EWOULDBLOCK)) {
+			rprintf(FERROR, "a --send-ahead helper exited early [%s]\n",
+				who_am_i());
+			exit_cleanup(RERR_IPC);
+		}
+	}
+}
+
+static void forward_ahead_req(struct ahead_req *req, int f_out, int itemizing)
+{
+	write_ndx_and_attrs(f_out, req->ndx, req->iflags,
+			    req->fnamecmp_type, req->xname, req->xlen);
+	if (req->iflags != ITEM_IS_NEW) {
+		maybe_log_item(the_file_list->files[req->ndx], req->iflags,
+			       itemizing, req->xname ? req->xname : "");
+	}
+}
+
+/* Handle one message from the oldest file's helper.  Returns 1 when that
+ * file is done. */
+static int ahead_msg(struct ahead_req *req, int tag, char *buf, int len,
+		     int f_out, int f_xfer)
+{
+	struct file_struct *file = the_file_list->files[req->ndx];
+	enum logcode log_code = log_before_transfer ? FLOG : FINFO;
+	struct ahead_done done;
+
+	switch (tag) {
+	case MSG_DATA:
+		write_buf(f_xfer, buf, len);
+		break;
+	case MSG_SUCCESS:
+		ahead_initial_stats = stats;
+		write_ndx_and_attrs(f_out, req->ndx, req->iflags,
+				    req->fnamecmp_type, req->xname, req->xlen);
+		write_sum_head(f_xfer, req->s);
+		if (log_before_transfer) {
+			log_item(FCLIENT, file, &ahead_initial_stats,
+				 req->iflags, NULL);
+		}
+		ahead_started = 1;
+		break;
+	case MSG_DONE:
+		if (len != sizeof done)
+			goto invalid;
+		memcpy(&done, buf, sizeof done);
+		io_error |= done.io_error;
+		stats.literal_data += done.literal_data;
+		stats.matched_data += done.matched_data;
+		add_match_totals(done.totals);
+		if (done.ok) {
+			log_item(log_code, file, &ahead_initial_stats,
+				 req->iflags, NULL);
+			/* Flag that we actually sent this entry. */
+			file->flags |= FLAG_SENT;
+		}
+		ahead_started = 0;
+		return 1;
+	case MSG_INFO:
+	case MSG_ERROR:
+	case MSG_LOG:
+		/* A server's helper has logged it already. */
+		if (am_server)
+			send_msg((enum msgcode)tag, buf, len);
+		else
+			rwrite((enum logcode)tag, buf, len);
+		break;
+	default:
+	  invalid:
+		rprintf(FERROR, "invalid message %d:%d from a --send-ahead helper [%s]\n",
+			tag, len, who_am_i());
+		exit_cleanup(RERR_IPC);
+	}
+	return 0;
+}
+
+/* Send what we can of the queued requests' output.  We return when the
+ * queue is empty, or (unless drain is set) when we can read another
+ * request. */
+static void send_ahead_output(int f_in, int f_out, int f_xfer, int drain)
+{
+	int itemizing = am_server ? logfile_format_has_i : stdout_format_has_i;
+
+	while (ahead_cnt) {
+		struct ahead_req *req = &ahead_queue[ahead_head];
+		struct ahead_helper *h;
+		int can_read = !drain && !ahead_started
+			    && ahead_jobs < ahead_helper_cnt
+			    && ahead_cnt < AHEAD_QUEUE;
+		int done = 0;
+
+		if (req->s) {
+			if (can_read && io_input_ready(f_in))
+				return;
+			h = &ahead_helpers[req->helper];
+			if (h->buf_cnt < 4 || h->buf_cnt < 4
+			    + (int)(IVAL(h->buf + h->buf_pos, 0) & 0xFFFFFF)) {
+				fill_ahead_bufs(h, can_read ? f_in : -1);
+				continue;
+			}
+			while (!done && h->buf_cnt >= 4) {
+				int tag = IVAL(h->buf + h->buf_pos, 0);
+				int len = tag & 0xFFFFFF;
+				tag = (tag >> 24) - MPLEX_BASE;
+				if (h->buf_cnt < 4 + len)
+					break;
+				done = ahead_msg(req, tag, h->buf + h->buf_pos + 4,
+						 len, f_out, f_xfer);
+				h->buf_pos += 4 + len;
+				h->buf_cnt -= 4 + len;
+			}
+			if (!done)
+				continue;
+			free_sums(req->s);
+			ahead_jobs--;
+		} else
+			forward_ahead_req(req, f_out, itemizing);
+
+		if (req->xname)
+			free(req->xname);
+		ahead_head = (ahead_head + 1) % AHEAD_QUEUE;
+		ahead_cnt--;
+	}
+}
+
 void send_files(struct file_list *flist, int f_out, int f_in)
 {
 	int fd = -1;
@@ -246,11 +758,40 @@ void send_files(struct file_list *flist, int f_out, int f_in)
 	if (verbose > 2)
 		rprintf(FINFO, "send_files starting\n");
 
+	if (send_ahead > 0 && do_xfers && !do_progress
+#ifdef HAVE_COPYFILE
+	 && !extended_attributes
+#endif
+	 && !remove_source_files && !write_batch)
+		start_send_ahead(f_in, f_out);
+
 	while (1) {
 		unsigned int offset;
 
+		if (ahead_cnt)
+			send_ahead_output(f_in, f_out, f_xfer, 0);
+
+		/* The next directory's sub-list can go out while we wait. */
+		if (inc_recurse)
+			io_set_sub_list_fd(f_out);
 		i = read_int(f_in);
+		if (inc_recurse) {
+			io_set_sub_list_fd(-1);
+			if (i == NDX_FLIST_DIR) {
+				sub_list_taken();
+				continue;
+			}
+		}
 		if (i == -1) {
+			/* The receiving side must have all the sub-lists
+			 * before the end of the first phase. */
+			if (inc_recurse && !phase) {
+				while (send_sub_list(f_out, flist)) {}
+			}
+			if (ahead_cnt)
+				send_ahead_output(f_in, f_out, f_xfer, 1);
+			if (ahead_helper_cnt)
+				stop_send_ahead();
 			if (++phase > max_phase)
 				break;
 			csum_length = SUM_LENGTH;
@@ -264,8 +805,15 @@ void send_files(struct file_list *flist, int f_out, int f_in)
 			continue;
 		}
 
-		iflags = read_item_attrs(f_in, f_out, i, &fnamecmp_type,
-					 xname, &xlen);
+		/* While earlier files are still with the helpers, a request
+		 * must wait its turn to be passed on. */
+		iflags = read_item_attrs(f_in, ahead_cnt ? -1 : f_out, i,
+					 &fnamecmp_type, xname, &xlen);
+		if (ahead_cnt && !(iflags & ITEM_TRANSFER)) {
+			queue_ahead(i, iflags, fnamecmp_type, xname, xlen,
+				    NULL, NULL);
+			continue;
+		}
 		if (iflags == ITEM_IS_NEW) /* no-op packet */
 			continue;
 
@@ -322,6 +870,12 @@ void send_files(struct file_list *flist, int f_out, int f_in)
 			return;
 		}
 
+		if (ahead_helper_cnt) {
+			queue_ahead(i, iflags, fnamecmp_type, xname, xlen,
+				    s, fname);
+			continue;
+		}
+
 #ifdef HAVE_COPYFILE
 		if (extended_attributes
 		    && !strncmp(file->basename, "._", 2)) {
@@ -384,6 +938,12 @@ void send_files(struct file_list *flist, int f_out, int f_in)
 			return;
 		}
 
+#ifdef HAVE_POSIX_FADVISE
+		/* match_sums() reads the file front to back, so let the kernel
+		 * read ahead while we search and write the previous chunk. */
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
 		if (st.st_size) {
 			int32 read_size = MAX(s->blength * 3, MAX_MAP_SIZE);
 			mbuf = map_file(fd, st.st_size, read_size, s->blength);
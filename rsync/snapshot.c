@@ -0,0 +1,697 @@
+/*
+ * A daemon module's file list, kept on disk between transfers.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street - Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* When a module has a "flist snapshot" file, the daemon's sender answers
+ * the lstat(), readlink(), and readdir() calls of its file-list walk from
+ * that file instead of from the disk, so a big, mostly idle module can be
+ * listed without touching every inode in it.  The snapshot is rebuilt by
+ * a background rescan (run as the module's uid, from inside its chroot)
+ * once it is older than "flist snapshot refresh" seconds.  Names that the
+ * snapshot doesn't cover fall back to the real system calls, and all the
+ * usual filter rules still apply since only the stat data is cached.
+ *
+ * The file holds one block per directory: a struct snap_dir, the sorted
+ * entries, the directory's module-relative path, and then the entries'
+ * names and symlink targets.  A hash table of the blocks' offsets, keyed
+ * by the directory path, follows the last block.  The module's root is
+ * the single entry "." of a directory whose path is "". */
+
+#include "rsync.h"
+
+#ifdef SUPPORT_FLIST_SNAPSHOT
+
+extern int am_sender;
+extern char curr_dir[MAXPATHLEN];
+
+#define SNAP_MAGIC "rsyncfs1"
+#define SNAP_ALIGN(x) (((x) + 7) & ~(int64)7)
+/* A rescan that hasn't written anything for this long is assumed dead. */
+#define SNAP_LOCK_STALE 600
+
+struct snap_head {
+	char magic[8];
+	int32 ent_size;		/* sizeof (struct snap_ent) */
+	int32 table_len;	/* slots in the hash table (a power of 2) */
+	int64 table_off;	/* offset of the hash table of int64 offsets */
+	int64 dir_cnt;
+};
+
+struct snap_dir {
+	uint32 size;		/* bytes in the block, names included */
+	int32 cnt;		/* struct snap_ent items that follow */
+};
+
+struct snap_ent {
+	int64 size, mtime, dev, ino, rdev;
+	uint32 mode, uid, gid, nlink;
+	uint32 name;		/* offset of the name within the block */
+	uint32 link;		/* offset of the symlink target, or 0 */
+};
+
+int snapshot_active = 0;
+
+static char *snap_fname;
+static int snap_fd = -1;
+static int snap_dirfd = -1;
+static char *snap_map;
+static int64 snap_len;
+static int64 *snap_table;
+static uint32 snap_table_mask;
+static char *snap_base;
+static int snap_base_len;
+
+/* The directory that snapshot_readdir() is returning names from. */
+static char *read_block;
+static int read_cnt, read_ndx;
+
+static uint32 snap_hash(const char *s)
+{
+	uint32 h = 2166136261U;
+
+	while (*s)
+		h = (h ^ *(uchar *)s++) * 16777619U;
+	return h;
+}
+
+/* Called in the daemon before the chroot, since the snapshot normally
+ * lives outside of the module. */
+void snapshot_open(const char *fname)
+{
+	char dirbuf[MAXPATHLEN], *slash;
+
+	if (strlcpy(dirbuf, fname, sizeof dirbuf) >= sizeof dirbuf - 4) {
+		rprintf(FLOG, "flist snapshot name is too long: %s\n", fname);
+		return;
+	}
+	if ((slash = strrchr(dirbuf, '/')) == NULL)
+		strlcpy(dirbuf, ".", sizeof dirbuf);
+	else if (slash == dirbuf)
+		slash[1] = '\0';
+	else
+		*slash = '\0';
+
+	if ((snap_dirfd = open(dirbuf, O_RDONLY)) < 0) {
+		rsyserr(FLOG, errno, "unable to open flist snapshot dir %s",
+			dirbuf);
+		return;
+	}
+	if ((snap_fd = open(fname, O_RDONLY)) < 0 && errno != ENOENT)
+		rsyserr(FLOG, errno, "unable to open flist snapshot %s", fname);
+
+	slash = strrchr(fname, '/');
+	snap_fname = strdup(slash ? slash + 1 : fname);
+}
+
+static int snap_map_file(void)
+{
+	struct snap_head *hd;
+	STRUCT_STAT st;
+
+	if (do_fstat(snap_fd, &st) < 0
+	 || st.st_size < (OFF_T)sizeof (struct snap_head))
+		return 0;
+	snap_len = st.st_size;
+	snap_map = mmap(NULL, snap_len, PROT_READ, MAP_SHARED, snap_fd, 0);
+	if (snap_map == (char *)MAP_FAILED) {
+		snap_map = NULL;
+		return 0;
+	}
+
+	hd = (struct snap_head *)snap_map;
+	if (memcmp(hd->magic, SNAP_MAGIC, sizeof hd->magic) != 0
+	 || hd->ent_size != sizeof (struct snap_ent)
+	 || hd->table_len <= 0 || (hd->table_len & (hd->table_len - 1))
+	 || hd->table_off < (int64)sizeof *hd || hd->table_off & 7
+	 || hd->table_off + (int64)hd->table_len * 8 > snap_len) {
+		rprintf(FLOG, "ignoring invalid flist snapshot %s\n",
+			snap_fname);
+		munmap(snap_map, snap_len);
+		snap_map = NULL;
+		return 0;
+	}
+	snap_table = (int64 *)(snap_map + hd->table_off);
+	snap_table_mask = hd->table_len - 1;
+
+	return 1;
+}
+
+/* Write a block to the rescan's output, returning its offset or -1. */
+static int64 snap_write(int fd, int64 *offp, char *buf, int64 len)
+{
+	int64 off = *offp;
+	static char zeros[8];
+
+	if (write(fd, buf, len) != len)
+		return -1;
+	*offp += len;
+	if (SNAP_ALIGN(*offp) != *offp) {
+		int pad = SNAP_ALIGN(*offp) - *offp;
+		if (write(fd, zeros, pad) != pad)
+			return -1;
+		*offp += pad;
+	}
+	return off;
+}
+
+static char *rescan_names;
+static size_t rescan_names_len, rescan_names_size;
+
+static size_t add_name(const char *name, size_t len)
+{
+	size_t off = rescan_names_len;
+
+	if (off + len + 1 > rescan_names_size) {
+		while (off + len + 1 > rescan_names_size) {
+			rescan_names_size = rescan_names_size
+					  ? rescan_names_size * 2 : 64 * 1024;
+		}
+		rescan_names = realloc_array(rescan_names, char,
+					     rescan_names_size);
+		if (!rescan_names)
+			out_of_memory("add_name");
+	}
+	memcpy(rescan_names + off, name, len);
+	rescan_names[off + len] = '\0';
+	rescan_names_len += len + 1;
+
+	return off;
+}
+
+static int name_compare(const size_t *n1, const size_t *n2)
+{
+	return strcmp(rescan_names + *n1, rescan_names + *n2);
+}
+
+static int rescan_out;
+static int64 rescan_off;
+static struct { uint32 hash; int64 off; } *rescan_dirs;
+static int64 rescan_dir_cnt, rescan_dir_max;
+
+/* Lists one directory into a block, pushing its subdirectories onto the
+ * stack.  Returns 0 on a write error. */
+static int rescan_dir(const char *dir, char ***stackp, int *depthp,
+		      int *stack_max)
+{
+	static size_t *names;
+	static struct snap_ent *ents;
+	static int names_max;
+	char fbuf[MAXPATHLEN], *p, *block;
+	struct dirent *di;
+	struct snap_dir sd;
+	STRUCT_STAT st;
+	int64 off, hdr_len, i, j;
+	int cnt = 0, kept = 0, first = *depthp;
+	size_t path_len = strlen(dir);
+	DIR *d = NULL;
+
+	if (*dir && !(d = opendir(dir)))
+		return 1; /* Left out, so the sender will look for itself. */
+
+	rescan_names_len = 0;
+	if (!*dir) {
+		names_max = MAX(names_max, 1);
+		names = realloc_array(names, size_t, names_max);
+		ents = realloc_array(ents, struct snap_ent, names_max);
+		if (!names || !ents)
+			out_of_memory("rescan_dir");
+		names[cnt++] = add_name(".", 1);
+	} else {
+		while ((di = readdir(d)) != NULL) {
+			char *dname = d_name(di);
+			if (dname[0] == '.' && (dname[1] == '\0'
+			    || (dname[1] == '.' && dname[2] == '\0')))
+				continue;
+			if (cnt == names_max) {
+				names_max = names_max ? names_max * 2 : 1024;
+				names = realloc_array(names, size_t, names_max);
+				ents = realloc_array(ents, struct snap_ent,
+						     names_max);
+				if (!names || !ents)
+					out_of_memory("rescan_dir");
+			}
+			names[cnt++] = add_name(dname, strlen(dname));
+		}
+		closedir(d);
+		if (cnt > 1) {
+			qsort(names, cnt, sizeof names[0],
+			      (int (*)(const void *, const void *))name_compare);
+		}
+	}
+
+	if (*dir && (path_len != 1 || *dir != '.')) {
+		strlcpy(fbuf, dir, sizeof fbuf);
+		p = fbuf + path_len;
+		*p++ = '/';
+	} else
+		p = fbuf;
+
+	for (i = 0; i < cnt; i++) {
+		struct snap_ent *ent = ents + kept;
+		char *name = rescan_names + names[i];
+		if (strlcpy(p, name, MAXPATHLEN - (p - fbuf))
+		    >= MAXPATHLEN - (size_t)(p - fbuf))
+			continue;
+		if (do_lstat(fbuf, &st) < 0)
+			continue;
+		memset(ent, 0, sizeof *ent);
+		ent->size = st.st_size;
+		ent->mtime = st.st_mtime;
+		ent->dev = st.st_dev;
+		ent->ino = st.st_ino;
+		ent->rdev = st.st_rdev;
+		ent->mode = st.st_mode;
+		ent->uid = st.st_uid;
+		ent->gid = st.st_gid;
+		ent->nlink = st.st_nlink;
+		ent->name = names[i];
+#ifdef SUPPORT_LINKS
+		if (S_ISLNK(st.st_mode)) {
+			char lnk[MAXPATHLEN];
+			int llen = readlink(fbuf, lnk, sizeof lnk - 1);
+			if (llen < 0)
+				continue;
+			ent->link = add_name(lnk, llen);
+		}
+#endif
+		if (S_ISDIR(st.st_mode)) {
+			if (*depthp == *stack_max) {
+				*stack_max = *stack_max ? *stack_max * 2 : 1024;
+				*stackp = realloc_array(*stackp, char *,
+							*stack_max);
+				if (!*stackp)
+					out_of_memory("rescan_dir");
+			}
+			if (!((*stackp)[(*depthp)++] = strdup(fbuf)))
+				out_of_memory("rescan_dir");
+		}
+		kept++;
+	}
+
+	hdr_len = sizeof sd + (int64)kept * sizeof ents[0];
+	if (hdr_len + path_len + 1 + rescan_names_len >= 0xFFFFFFFFU)
+		return 1;
+	sd.cnt = kept;
+	sd.size = hdr_len + path_len + 1 + rescan_names_len;
+	for (i = 0; i < kept; i++) {
+		ents[i].name += hdr_len + path_len + 1;
+		if (ents[i].link)
+			ents[i].link += hdr_len + path_len + 1;
+	}
+
+	if (!(block = new_array(char, sd.size)))
+		out_of_memory("rescan_dir");
+	memcpy(block, &sd, sizeof sd);
+	memcpy(block + sizeof sd, ents, kept * sizeof ents[0]);
+	memcpy(block + hdr_len, dir, path_len + 1);
+	memcpy(block + hdr_len + path_len + 1, rescan_names, rescan_names_len);
+	off = snap_write(rescan_out, &rescan_off, block, sd.size);
+	free(block);
+	if (off < 0)
+		return 0;
+
+	if (rescan_dir_cnt == rescan_dir_max) {
+		rescan_dir_max = rescan_dir_max ? rescan_dir_max * 2 : 1024;
+		rescan_dirs = realloc(rescan_dirs,
+				      rescan_dir_max * sizeof rescan_dirs[0]);
+		if (!rescan_dirs)
+			out_of_memory("rescan_dir");
+	}
+	rescan_dirs[rescan_dir_cnt].hash = snap_hash(dir);
+	rescan_dirs[rescan_dir_cnt].off = off;
+	rescan_dir_cnt++;
+
+	/* The stack would pop the last name first, so reverse what we
+	 * added to keep the blocks in the order that the sender walks. */
+	for (i = first, j = *depthp - 1; i < j; i++, j--) {
+		char *tmp = (*stackp)[i];
+		(*stackp)[i] = (*stackp)[j];
+		(*stackp)[j] = tmp;
+	}
+
+	return 1;
+}
+
+/* Walks the module (our cwd) into a new snapshot file.  This runs in a
+ * process of its own, which has already dropped to the module's uid. */
+static void rescan(void)
+{
+	char tmpname[MAXPATHLEN], **stack = NULL;
+	int depth = 0, stack_max = 0, root_fd, table_len, ok = 1, try;
+	struct snap_head hd;
+	int64 *table, i;
+	STRUCT_STAT st;
+
+	snprintf(tmpname, sizeof tmpname, "%s.new", snap_fname);
+	if ((root_fd = open(".", O_RDONLY)) < 0 || fchdir(snap_dirfd) < 0)
+		return;
+	for (try = 0; ; try++) {
+		rescan_out = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (rescan_out >= 0 || errno != EEXIST || try
+		 || do_stat(tmpname, &st) < 0
+		 || st.st_mtime + SNAP_LOCK_STALE > time(NULL))
+			break;
+		unlink(tmpname);
+	}
+	if (rescan_out < 0) {
+		if (errno != EEXIST) {
+			rsyserr(FLOG, errno, "unable to create flist snapshot %s",
+				tmpname);
+		}
+		return;
+	}
+	if (fchdir(root_fd) < 0)
+		ok = 0;
+
+	memset(&hd, 0, sizeof hd);
+	rescan_off = sizeof hd;
+	if (ok && lseek(rescan_out, rescan_off, SEEK_SET) != rescan_off)
+		ok = 0;
+	if (ok)
+		ok = rescan_dir("", &stack, &depth, &stack_max);
+	while (depth) {
+		char *dir = stack[--depth];
+		if (ok)
+			ok = rescan_dir(dir, &stack, &depth, &stack_max);
+		free(dir);
+	}
+
+	for (table_len = 16; table_len < rescan_dir_cnt * 2; table_len *= 2) {}
+	if (!(table = new_array(int64, table_len)))
+		out_of_memory("rescan");
+	memset(table, 0, table_len * sizeof table[0]);
+	for (i = 0; i < rescan_dir_cnt; i++) {
+		uint32 j = rescan_dirs[i].hash & (table_len - 1);
+		while (table[j])
+			j = (j + 1) & (table_len - 1);
+		table[j] = rescan_dirs[i].off;
+	}
+
+	memcpy(hd.magic, SNAP_MAGIC, sizeof hd.magic);
+	hd.ent_size = sizeof (struct snap_ent);
+	hd.table_len = table_len;
+	hd.dir_cnt = rescan_dir_cnt;
+	if (ok && (hd.table_off = snap_write(rescan_out, &rescan_off,
+			(char *)table, table_len * sizeof table[0])) < 0)
+		ok = 0;
+	if (ok && (lseek(rescan_out, 0, SEEK_SET) != 0
+		|| write(rescan_out, &hd, sizeof hd) != sizeof hd))
+		ok = 0;
+	if (close(rescan_out) < 0)
+		ok = 0;
+
+	if (fchdir(snap_dirfd) < 0)
+		return;
+	if (!ok) {
+		rsyserr(FLOG, errno, "unable to write flist snapshot %s",
+			tmpname);
+		unlink(tmpname);
+	} else if (rename(tmpname, snap_fname) < 0) {
+		rsyserr(FLOG, errno, "unable to rename %s to %s",
+			tmpname, snap_fname);
+		unlink(tmpname);
+	}
+}
+
+/* Called in the daemon once it is inside the module and running as the
+ * module's uid.  Starts a rescan if the snapshot is missing or stale, and
+ * decides if this transfer's sender will use the snapshot. */
+void snapshot_start(int refresh, int f_in, int f_out)
+{
+	STRUCT_STAT st;
+	pid_t pid;
+
+	if (snap_dirfd < 0)
+		return;
+
+	if (snap_fd < 0 || (refresh > 0 && do_fstat(snap_fd, &st) == 0
+			    && st.st_mtime + refresh <= time(NULL))) {
+		if ((pid = fork()) < 0)
+			rsyserr(FLOG, errno, "fork failed in snapshot_start");
+		else if (pid == 0) {
+			/* Detach the rescan from this transfer entirely. */
+			if (fork() == 0) {
+				close(f_in);
+				if (f_out != f_in)
+					close(f_out);
+				rescan();
+			}
+			_exit(0);
+		} else
+			waitpid(pid, NULL, 0);
+	}
+
+	if (am_sender && snap_fd >= 0 && snap_map_file()) {
+		snap_base = strdup(curr_dir);
+		snap_base_len = strlen(snap_base);
+		snapshot_active = 1;
+	} else if (snap_fd >= 0) {
+		close(snap_fd);
+		snap_fd = -1;
+	}
+	close(snap_dirfd);
+	snap_dirfd = -1;
+}
+
+/* Turns a path from the sender's walk into a module-relative one in buf,
+ * or returns NULL if the snapshot can't say anything about it. */
+static char *snap_path(const char *path, char *buf)
+{
+	char *rel;
+	int len;
+
+	if (*path == '/') {
+		if (strlcpy(buf, path, MAXPATHLEN) >= MAXPATHLEN)
+			return NULL;
+	} else if (pathjoin(buf, MAXPATHLEN, curr_dir, path) >= MAXPATHLEN)
+		return NULL;
+	clean_fname(buf, 0);
+
+	if (snap_base_len == 1)
+		rel = buf + 1;
+	else if (strncmp(buf, snap_base, snap_base_len) != 0)
+		return NULL;
+	else if (buf[snap_base_len] == '/')
+		rel = buf + snap_base_len + 1;
+	else if (!buf[snap_base_len])
+		rel = buf + snap_base_len;
+	else
+		return NULL;
+
+	len = strlen(rel);
+	if (len >= 2 && rel[len-1] == '.' && rel[len-2] == '/')
+		rel[len -= 2] = '\0';
+	if (!len)
+		return strcpy(rel, ".");
+	if ((rel[0] == '.' && rel[1] == '.' && (!rel[2] || rel[2] == '/'))
+	 || strstr(rel, "/../")
+	 || (len >= 3 && strcmp(rel + len - 3, "/..") == 0))
+		return NULL;
+
+	return rel;
+}
+
+/* Returns the (sanity-checked) block of the named directory, or NULL. */
+static char *snap_dir_block(const char *dir)
+{
+	uint32 j = snap_hash(dir) & snap_table_mask, tries;
+
+	for (tries = 0; tries <= snap_table_mask; tries++) {
+		int64 off = snap_table[j];
+		struct snap_dir *sd;
+		int64 hdr_len;
+		char *block;
+
+		if (off <= 0 || off & 7 || off + (int64)sizeof *sd > snap_len)
+			return NULL;
+		block = snap_map + off;
+		sd = (struct snap_dir *)block;
+		hdr_len = sizeof *sd + (int64)sd->cnt * sizeof (struct snap_ent);
+		if (sd->cnt < 0 || sd->size > snap_len - off
+		 || hdr_len >= sd->size || block[sd->size - 1] != '\0')
+			return NULL;
+		if (strcmp(block + hdr_len, dir) == 0)
+			return block;
+		j = (j + 1) & snap_table_mask;
+	}
+
+	return NULL;
+}
+
+/* Returns 1 if every entry in block has a name that can be in a directory
+ * (the snapshot file is not trusted): not empty, ".", "..", or with a '/'.
+ * The "" block holds the module's own "." entry.  The answer for the last
+ * block is remembered, since the sender lists a dir and then stats it. */
+static int snap_block_ok(char *block)
+{
+	static char *checked_block;
+	static int checked_ok;
+	struct snap_dir *sd = (struct snap_dir *)block;
+	struct snap_ent *ents = (struct snap_ent *)(block + sizeof *sd);
+	uint32 hdr_len = sizeof *sd + (uint32)sd->cnt * sizeof (struct snap_ent);
+	int i, is_top = !block[hdr_len];
+
+	if (block == checked_block)
+		return checked_ok;
+
+	checked_block = block;
+	checked_ok = 0;
+	for (i = 0; i < sd->cnt; i++) {
+		char *name;
+		if (ents[i].name < hdr_len || ents[i].name >= sd->size)
+			return 0;
+		name = block + ents[i].name;
+		if (!*name || strchr(name, '/'))
+			return 0;
+		if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))
+		 && !(is_top && !name[1]))
+			return 0;
+	}
+	checked_ok = 1;
+
+	return 1;
+}
+
+static struct snap_ent *snap_find_ent(char *block, const char *name)
+{
+	struct snap_dir *sd = (struct snap_dir *)block;
+	struct snap_ent *ents = (struct snap_ent *)(block + sizeof *sd);
+	int lo = 0, hi = sd->cnt - 1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2, cmp;
+		if (ents[mid].name >= sd->size)
+			return NULL;
+		cmp = strcmp(block + ents[mid].name, name);
+		if (cmp == 0)
+			return ents + mid;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return NULL;
+}
+
+/* Finds path's entry.  Returns 0 if the snapshot doesn't know path's
+ * directory, else 1 with *entp set to NULL if the name isn't in it. */
+static int snap_lookup(const char *path, char **blockp, struct snap_ent **entp)
+{
+	char buf[MAXPATHLEN], *rel, *name;
+
+	if (!(rel = snap_path(path, buf)))
+		return 0;
+	if (rel[0] == '.' && !rel[1]) {
+		*blockp = snap_dir_block("");
+		name = rel;
+	} else if ((name = strrchr(rel, '/')) != NULL) {
+		*name++ = '\0';
+		*blockp = snap_dir_block(rel);
+	} else {
+		*blockp = snap_dir_block(".");
+		name = rel;
+	}
+	if (!*blockp || !snap_block_ok(*blockp))
+		return 0;
+	*entp = snap_find_ent(*blockp, name);
+
+	return 1;
+}
+
+/* Like do_lstat() (or do_stat() if follow_links is set), but from the
+ * snapshot.  Returns SNAPSHOT_MISS if the caller must ask the disk. */
+int snapshot_stat(const char *path, STRUCT_STAT *stp, int follow_links)
+{
+	struct snap_ent *ent;
+	char *block;
+
+	if (!snap_lookup(path, &block, &ent))
+		return SNAPSHOT_MISS;
+	if (!ent) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (follow_links && S_ISLNK(ent->mode))
+		return SNAPSHOT_MISS;
+
+	memset(stp, 0, sizeof *stp);
+	stp->st_size = ent->size;
+	stp->st_mtime = ent->mtime;
+	stp->st_dev = ent->dev;
+	stp->st_ino = ent->ino;
+	stp->st_rdev = ent->rdev;
+	stp->st_mode = ent->mode;
+	stp->st_uid = ent->uid;
+	stp->st_gid = ent->gid;
+	stp->st_nlink = ent->nlink;
+
+	return 0;
+}
+
+int snapshot_readlink(const char *path, char *buf, size_t bufsiz)
+{
+	struct snap_ent *ent;
+	char *block;
+	size_t len;
+
+	if (!snap_lookup(path, &block, &ent))
+		return SNAPSHOT_MISS;
+	if (!ent || !S_ISLNK(ent->mode)) {
+		errno = ent ? EINVAL : ENOENT;
+		return -1;
+	}
+	if (!ent->link || ent->link >= ((struct snap_dir *)block)->size)
+		return SNAPSHOT_MISS;
+	if ((len = strlen(block + ent->link)) > bufsiz)
+		len = bufsiz;
+	memcpy(buf, block + ent->link, len);
+
+	return len;
+}
+
+/* Returns 1 if snapshot_readdir() can list the directory.  A block with a
+ * bad name in it is left to the disk (for the stats too), so that we never
+ * list a name such as ".." that would lead out of the directory. */
+int snapshot_opendir(const char *path)
+{
+	char buf[MAXPATHLEN], *rel;
+
+	if (!(rel = snap_path(path, buf)) || !(read_block = snap_dir_block(rel))
+	 || !snap_block_ok(read_block))
+		return 0;
+	read_cnt = ((struct snap_dir *)read_block)->cnt;
+	read_ndx = 0;
+
+	return 1;
+}
+
+char *snapshot_readdir(void)
+{
+	struct snap_dir *sd = (struct snap_dir *)read_block;
+	struct snap_ent *ent;
+
+	if (read_ndx >= read_cnt)
+		return NULL;
+	ent = (struct snap_ent *)(read_block + sizeof *sd) + read_ndx++;
+	if (ent->name >= sd->size)
+		return NULL;
+
+	return read_block + ent->name;
+}
+
+#endif
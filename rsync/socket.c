@@ -31,7 +31,10 @@
 #include <netinet/tcp.h>
 
 extern char *bind_address;
+extern char *sockopts;
 extern int default_af_hint;
+extern int am_server;
+extern struct stats stats;
 
 #ifdef HAVE_SIGACTION
 static struct sigaction sigact;
@@ -261,6 +264,9 @@ int open_socket_out(char *host, int port, const char *bind_addr,
 			s = -1;
 			continue;
 		}
+		/* Buffer sizes must be set before connect() so that the
+		 * TCP window-scale negotiated in the SYN can use them. */
+		set_socket_options(s, sockopts);
 		if (connect(s, res->ai_addr, res->ai_addrlen) < 0) {
 			close(s);
 			s = -1;
@@ -306,8 +312,12 @@ int open_socket_out_wrapped(char *host, int port, const char *bind_addr,
 			prog ? "Using RSYNC_CONNECT_PROG instead of " : "",
 			host, port);
 	}
-	if (prog)
-		return sock_exec(prog);
+	if (prog) {
+		int fd = sock_exec(prog);
+		if (fd >= 0)
+			set_socket_options(fd, sockopts);
+		return fd;
+	}
 	return open_socket_out(host, port, bind_addr, af_hint);
 }
 
@@ -466,6 +476,7 @@ void start_accept_loop(int port, int (*fn)(int, int))
 {
 	fd_set deffds;
 	int *sp, maxfd, i;
+	char *opts = sockopts ? sockopts : lp_socket_options();
 
 #ifdef HAVE_SIGACTION
 	sigact.sa_flags = SA_NOCLDSTOP;
@@ -479,6 +490,9 @@ void start_accept_loop(int port, int (*fn)(int, int))
 	/* ready to listen */
 	FD_ZERO(&deffds);
 	for (i = 0, maxfd = -1; sp[i] >= 0; i++) {
+		/* Accepted sockets inherit the listener's buffer sizes,
+		 * which lets a large SO_RCVBUF affect the window scale. */
+		set_socket_options(sp[i], opts);
 		if (listen(sp[i], 5) < 0) {
 			rsyserr(FERROR, errno, "listen() on socket failed");
 #ifdef INET6
@@ -556,7 +570,7 @@ void start_accept_loop(int port, int (*fn)(int, int))
 }
 
 
-enum SOCK_OPT_TYPES {OPT_BOOL,OPT_INT,OPT_ON};
+enum SOCK_OPT_TYPES {OPT_BOOL,OPT_INT,OPT_ON,OPT_BUF};
 
 struct
 {
@@ -579,10 +593,10 @@ struct
   {"IPTOS_THROUGHPUT",  IPPROTO_IP,    IP_TOS,          IPTOS_THROUGHPUT,  OPT_ON},
 #endif
 #ifdef SO_SNDBUF
-  {"SO_SNDBUF",         SOL_SOCKET,    SO_SNDBUF,       0,                 OPT_INT},
+  {"SO_SNDBUF",         SOL_SOCKET,    SO_SNDBUF,       0,                 OPT_BUF},
 #endif
 #ifdef SO_RCVBUF
-  {"SO_RCVBUF",         SOL_SOCKET,    SO_RCVBUF,       0,                 OPT_INT},
+  {"SO_RCVBUF",         SOL_SOCKET,    SO_RCVBUF,       0,                 OPT_BUF},
 #endif
 #ifdef SO_SNDLOWAT
   {"SO_SNDLOWAT",       SOL_SOCKET,    SO_SNDLOWAT,     0,                 OPT_INT},
@@ -598,6 +612,12 @@ struct
 #endif
   {NULL,0,0,0,0}};
 
+/* The buffer options that were given a value of "auto". */
+static int auto_bufs[2], auto_buf_cnt;
+static int64 rtt_usec;
+static struct timeval probe_tv;
+static int64 probe_bytes;
+
 
 
 /**
@@ -616,15 +636,16 @@ void set_socket_options(int fd, char *options)
 		out_of_memory("set_socket_options");
 
 	for (tok = strtok(options, " \t,"); tok; tok = strtok(NULL," \t,")) {
-		int ret=0,i;
+		int ret=0,i,j;
 		int value = 1;
 		char *p;
-		int got_value = 0;
+		int got_value = 0, got_auto = 0;
 
 		if ((p = strchr(tok,'='))) {
 			*p = 0;
 			value = atoi(p+1);
 			got_value = 1;
+			got_auto = strcmp(p+1, "auto") == 0;
 		}
 
 		for (i = 0; socket_options[i].name; i++) {
@@ -637,7 +658,23 @@ void set_socket_options(int fd, char *options)
 			continue;
 		}
 
+		if (got_auto && socket_options[i].opttype != OPT_BUF) {
+			rprintf(FERROR,"syntax error -- %s does not take auto\n",tok);
+			continue;
+		}
+
 		switch (socket_options[i].opttype) {
+		case OPT_BUF:
+			if (got_auto) {
+				for (j = 0; j < auto_buf_cnt; j++) {
+					if (auto_bufs[j] == socket_options[i].option)
+						break;
+				}
+				if (j == auto_buf_cnt)
+					auto_bufs[auto_buf_cnt++] = socket_options[i].option;
+				break;
+			}
+			/* FALL THROUGH */
 		case OPT_BOOL:
 		case OPT_INT:
 			ret = setsockopt(fd,socket_options[i].level,
@@ -667,6 +704,133 @@ void set_socket_options(int fd, char *options)
 	free(options);
 }
 
+/**
+ * Note the time at which we sent something that the other side answers
+ * right away, so that finish_rtt_probe() can measure the round-trip time
+ * for the "auto" socket-buffer sizing.
+ **/
+void start_rtt_probe(void)
+{
+	if (auto_buf_cnt && !rtt_usec)
+		gettimeofday(&probe_tv, NULL);
+}
+
+void finish_rtt_probe(void)
+{
+	struct timeval tv;
+
+	if (!auto_buf_cnt || rtt_usec || !probe_tv.tv_sec)
+		return;
+
+	gettimeofday(&tv, NULL);
+	rtt_usec = (int64)(tv.tv_sec - probe_tv.tv_sec) * 1000000
+		 + (tv.tv_usec - probe_tv.tv_usec);
+	if (rtt_usec <= 0)
+		rtt_usec = 1;
+	probe_tv.tv_sec = 0;
+}
+
+/**
+ * Start measuring the throughput of the socket (called when the file
+ * list starts to move).
+ **/
+void start_throughput_probe(void)
+{
+	if (!auto_buf_cnt || !rtt_usec)
+		return;
+
+	gettimeofday(&probe_tv, NULL);
+	probe_bytes = stats.total_read + stats.total_written;
+}
+
+/**
+ * Returns the largest size that the kernel's own TCP buffer tuning will
+ * grow the given buffer to, or 0 if it doesn't do any.  Setting a size
+ * turns that tuning off for the socket (on Linux), so we only want to do
+ * it when we need more than the tuning would ever give us.
+ **/
+static int autotune_limit(int option)
+{
+	char *fn = option == SO_RCVBUF ? "/proc/sys/net/ipv4/tcp_rmem"
+				       : "/proc/sys/net/ipv4/tcp_wmem";
+	long min, def, max;
+	FILE *fp;
+	int ok;
+
+	if (option == SO_RCVBUF) {
+		if (!(fp = fopen("/proc/sys/net/ipv4/tcp_moderate_rcvbuf", "r")))
+			return 0;
+		ok = fscanf(fp, "%ld", &def) == 1 && def != 0;
+		fclose(fp);
+		if (!ok)
+			return 0;
+	}
+
+	if (!(fp = fopen(fn, "r")))
+		return 0;
+	ok = fscanf(fp, "%ld %ld %ld", &min, &def, &max) == 3;
+	fclose(fp);
+
+	return ok && max > 0 ? (int)MIN(max, INT_MAX) : 0;
+}
+
+/**
+ * Size the "auto" socket buffers (and our own output buffer) to match
+ * the bandwidth-delay product: the throughput seen since the call to
+ * start_throughput_probe() times the measured round-trip time.  Since
+ * that throughput was itself limited by the current buffers, we allow
+ * for twice as much, and we never shrink a buffer.  Nor do we set one
+ * that the kernel's tuning can still grow that far by itself, since the
+ * size we set would then be all the buffer ever gets.
+ **/
+void adapt_socket_buffers(int fd)
+{
+	struct timeval tv;
+	int64 elapsed, bytes;
+	double rate;
+	int i, want, cur;
+	socklen_t len;
+
+	if (!auto_buf_cnt || !rtt_usec || !probe_tv.tv_sec)
+		return;
+
+	gettimeofday(&tv, NULL);
+	elapsed = (int64)(tv.tv_sec - probe_tv.tv_sec) * 1000000
+		+ (tv.tv_usec - probe_tv.tv_usec);
+	bytes = stats.total_read + stats.total_written - probe_bytes;
+	probe_tv.tv_sec = 0;
+	if (elapsed <= 0 || bytes <= 0)
+		return;
+
+	rate = (double)bytes * 1000000 / elapsed;
+	if (rate * rtt_usec * 2 / 1000000 > MAX_SOCKBUF_SIZE)
+		want = MAX_SOCKBUF_SIZE;
+	else
+		want = (int)(rate * rtt_usec * 2 / 1000000);
+
+	for (i = 0; i < auto_buf_cnt; i++) {
+		len = sizeof cur;
+		if (getsockopt(fd, SOL_SOCKET, auto_bufs[i],
+			       (char *)&cur, &len) == 0 && cur >= want)
+			continue;
+		if (want <= autotune_limit(auto_bufs[i]))
+			continue;
+		if (setsockopt(fd, SOL_SOCKET, auto_bufs[i],
+			       (char *)&want, sizeof want) != 0) {
+			rsyserr(FERROR, errno,
+				"failed to set socket buffer size to %d", want);
+		}
+	}
+
+	io_grow_buffering_out(want);
+
+	if (verbose > 1 && !am_server) {
+		rprintf(FINFO,
+			"rtt %.1f ms, %.0f bytes/sec: socket buffers >= %d bytes\n",
+			(double)rtt_usec / 1000, rate, want);
+	}
+}
+
 /**
  * Become a daemon, discarding the controlling terminal
  **/
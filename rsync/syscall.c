@@ -55,6 +55,7 @@ int do_unlink(const char *fname)
 {
 	if (dry_run) return 0;
 	RETURN_ERROR_IF_RO_OR_LO;
+	forget_attrs_dir();
 #ifdef HAVE_COPYFILE
 	if (extended_attributes && !strncmp("._", basename(fname), 2))
 	{
@@ -70,6 +71,108 @@ int do_unlink(const char *fname)
 	return unlink(fname);
 }
 
+#ifdef HAVE_UNLINKAT
+/* These remove a name relative to an open directory (see generator.c). */
+int do_unlink_at(int dfd, const char *fname)
+{
+	if (dry_run) return 0;
+	RETURN_ERROR_IF_RO_OR_LO;
+	forget_attrs_dir();
+#ifdef HAVE_COPYFILE
+	if (extended_attributes && !strncmp("._", fname, 2)) {
+		if (unlinkat(dfd, fname, 0) < 0 && errno != ENOENT)
+			return -1;
+		return 0;
+	}
+#endif
+	return unlinkat(dfd, fname, 0);
+}
+
+int do_rmdir_at(int dfd, const char *fname)
+{
+	if (dry_run) return 0;
+	RETURN_ERROR_IF_RO_OR_LO;
+	forget_attrs_dir();
+	return unlinkat(dfd, fname, AT_REMOVEDIR);
+}
+#endif
+
+#ifdef SUPPORT_ATTRS_AT
+/* set_file_attrs() is called on the items the generator makes (and on the
+ * unchanged ones) in file-list order, so most of them are in the same dir
+ * as the one before.  We keep that dir open and use the *at() calls on the
+ * last element of the name, which spares the kernel a lookup of the whole
+ * path for each call.  Since the fd follows the dir and not its name, it is
+ * dropped whenever we rename or remove something, or chdir. */
+static int attrs_dirfd = -1;
+static int attrs_dir_len = -1;
+static char attrs_dir[MAXPATHLEN];
+
+void forget_attrs_dir(void)
+{
+	if (attrs_dirfd >= 0)
+		close(attrs_dirfd);
+	attrs_dirfd = attrs_dir_len = -1;
+}
+
+/* Returns the last element of fname and sets *dfd_p to its open dir, or
+ * returns NULL if the full name should be used. */
+char *attrs_dir_name(char *fname, int *dfd_p)
+{
+	char *slash = strrchr(fname, '/');
+	int len;
+
+	if (dry_run || !slash || slash == fname || !slash[1])
+		return NULL;
+	len = slash - fname;
+	if (len != attrs_dir_len || strncmp(attrs_dir, fname, len) != 0) {
+		forget_attrs_dir();
+		memcpy(attrs_dir, fname, len);
+		attrs_dir[len] = '\0';
+		attrs_dir_len = len;
+		/* If this fails, we use full names until the dir changes. */
+#ifdef O_PATH
+		attrs_dirfd = open(attrs_dir, O_PATH | O_DIRECTORY);
+#elif defined O_DIRECTORY
+		attrs_dirfd = open(attrs_dir, O_RDONLY | O_DIRECTORY);
+#else
+		attrs_dirfd = open(attrs_dir, O_RDONLY);
+#endif
+	}
+	if (attrs_dirfd < 0)
+		return NULL;
+	*dfd_p = attrs_dirfd;
+	return slash + 1;
+}
+
+/* These change a name relative to an open directory (see above). */
+int do_lchown_at(int dfd, const char *fname, uid_t owner, gid_t group)
+{
+	if (dry_run) return 0;
+	RETURN_ERROR_IF_RO_OR_LO;
+#ifdef HAVE_LCHOWN
+	return fchownat(dfd, fname, owner, group, AT_SYMLINK_NOFOLLOW);
+#else
+	return fchownat(dfd, fname, owner, group, 0);
+#endif
+}
+
+int do_chmod_at(int dfd, const char *fname, mode_t mode)
+{
+	int code;
+	if (dry_run) return 0;
+	RETURN_ERROR_IF_RO_OR_LO;
+	code = fchmodat(dfd, fname, mode & CHMOD_BITS, 0);
+	if (code != 0 && preserve_perms)
+	    return code;
+	return 0;
+}
+#else
+void forget_attrs_dir(void)
+{
+}
+#endif
+
 int do_symlink(const char *fname1, const char *fname2)
 {
 	if (dry_run) return 0;
@@ -96,6 +199,15 @@ int do_lchown(const char *path, uid_t owner, gid_t group)
 	return lchown(path, owner, group);
 }
 
+#ifdef HAVE_FCHOWN
+int do_fchown(int fd, uid_t owner, gid_t group)
+{
+	if (dry_run) return 0;
+	RETURN_ERROR_IF_RO_OR_LO;
+	return fchown(fd, owner, group);
+}
+#endif
+
 int do_mknod(char *pathname, mode_t mode, dev_t dev)
 {
 	if (dry_run) return 0;
@@ -140,6 +252,7 @@ int do_rmdir(const char *pathname)
 {
 	if (dry_run) return 0;
 	RETURN_ERROR_IF_RO_OR_LO;
+	forget_attrs_dir();
 	return rmdir(pathname);
 }
 
@@ -173,10 +286,20 @@ int do_chmod(const char *path, mode_t mode)
 }
 #endif
 
+#ifdef HAVE_FCHMOD
+int do_fchmod(int fd, mode_t mode)
+{
+	if (dry_run) return 0;
+	RETURN_ERROR_IF_RO_OR_LO;
+	return fchmod(fd, mode & CHMOD_BITS);
+}
+#endif
+
 int do_rename(const char *fname1, const char *fname2)
 {
 	if (dry_run) return 0;
 	RETURN_ERROR_IF_RO_OR_LO;
+	forget_attrs_dir();
 #ifdef HAVE_COPYFILE
 	if(extended_attributes)
 	{
@@ -252,6 +375,115 @@ int do_mkstemp(char *template, mode_t perms)
 #endif
 }
 
+#if defined O_TMPFILE && defined HAVE_LINKAT
+#define USE_O_TMPFILE 1
+static int unnamed_fd = -1;
+#endif
+
+/* On Linux we can create a temp file with no name (O_TMPFILE) and give it
+ * a name only when its data is complete, so an interrupted transfer leaves
+ * nothing behind in the destination dir.  The XXXXXX in the template stays
+ * unfilled until do_link_tmpfile() picks the name.  If we can't do this
+ * here, -1 is returned and the caller should use do_mkstemp(). */
+int do_open_tmpfile(char *template, mode_t perms)
+{
+#ifdef USE_O_TMPFILE
+	static int have_proc_fd = -1;
+	char dirbuf[MAXPATHLEN], *slash;
+	int fd;
+
+	RETURN_ERROR_IF(dry_run, 0);
+	RETURN_ERROR_IF(read_only, EROFS);
+
+	/* The file gets its name by linking its /proc/self/fd entry. */
+	if (have_proc_fd < 0)
+		have_proc_fd = access("/proc/self/fd", X_OK) == 0;
+	if (!have_proc_fd) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	if ((slash = strrchr(template, '/')) != NULL)
+		strlcpy(dirbuf, template, slash - template + 2);
+	else
+		strlcpy(dirbuf, ".", sizeof dirbuf);
+
+	if ((fd = open(dirbuf, O_TMPFILE | O_RDWR | O_BINARY, perms)) < 0)
+		return -1;
+	if (fchmod(fd, perms) != 0 && preserve_perms) {
+		int errno_save = errno;
+		close(fd);
+		errno = errno_save;
+		return -1;
+	}
+	unnamed_fd = fd;
+	return fd;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* Give the file that do_open_tmpfile() returned a name by filling in the
+ * template's XXXXXX.  This does nothing for a file that already has a name,
+ * so it can be called for any temp file before it is closed. */
+int do_link_tmpfile(int fd, char *template)
+{
+#ifdef USE_O_TMPFILE
+	static const char letters[] =
+	    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	static unsigned long seed;
+	char procname[64], *x;
+	int tries, j;
+
+	if (fd < 0 || fd != unnamed_fd)
+		return 0;
+	unnamed_fd = -1;
+
+	snprintf(procname, sizeof procname, "/proc/self/fd/%d", fd);
+	x = template + strlen(template) - 6;
+	if (!seed)
+		seed = (unsigned long)getpid() * 69069 + time(NULL);
+
+	for (tries = 0; tries < 100; tries++) {
+		unsigned long val = seed = seed * 69069 + 1;
+		for (j = 0; j < 6; j++) {
+			x[j] = letters[val % 62];
+			val /= 62;
+		}
+		if (linkat(AT_FDCWD, procname, AT_FDCWD, template,
+			   AT_SYMLINK_FOLLOW) == 0)
+			return 0;
+		if (errno != EEXIST)
+			break;
+	}
+	memcpy(x, "XXXXXX", 6);
+	return -1;
+#else
+	return 0;
+#endif
+}
+
+/* Called for an unnamed temp file that is about to be closed without a
+ * name, which discards it. */
+void forget_tmpfile(UNUSED(int fd))
+{
+#ifdef USE_O_TMPFILE
+	if (fd == unnamed_fd)
+		unnamed_fd = -1;
+#endif
+}
+
+/* Returns 1 if fd is a temp file that has not been given a name yet. */
+int tmpfile_is_unnamed(UNUSED(int fd))
+{
+#ifdef USE_O_TMPFILE
+	return fd >= 0 && fd == unnamed_fd;
+#else
+	return 0;
+#endif
+}
+
 int do_stat(const char *fname, STRUCT_STAT *st)
 {
 #ifdef USE_STAT64_FUNCS
@@ -274,6 +506,31 @@ int do_lstat(const char *fname, STRUCT_STAT *st)
 #endif
 }
 
+#ifdef HAVE_FSTATAT
+/* These stat a name relative to an open directory (see flist.c). */
+int do_stat_at(int dfd, const char *fname, STRUCT_STAT *st)
+{
+#ifdef USE_STAT64_FUNCS
+	return fstatat64(dfd, fname, st, 0);
+#else
+	return fstatat(dfd, fname, st, 0);
+#endif
+}
+
+int do_lstat_at(int dfd, const char *fname, STRUCT_STAT *st)
+{
+#ifdef SUPPORT_LINKS
+# ifdef USE_STAT64_FUNCS
+	return fstatat64(dfd, fname, st, AT_SYMLINK_NOFOLLOW);
+# else
+	return fstatat(dfd, fname, st, AT_SYMLINK_NOFOLLOW);
+# endif
+#else
+	return do_stat_at(dfd, fname, st);
+#endif
+}
+#endif
+
 int do_fstat(int fd, STRUCT_STAT *st)
 {
 #ifdef USE_STAT64_FUNCS
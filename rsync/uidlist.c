@@ -47,6 +47,12 @@ struct idlist {
 static struct idlist *uidlist;
 static struct idlist *gidlist;
 
+/* The nodes at the head of the sending side's lists are the ones it hasn't
+ * sent yet, since add_to_list() puts new ones first.  These mark where the
+ * ones already sent begin, so that each --inc-recursive sub-list only
+ * sends the names it adds. */
+static struct idlist *uids_sent, *gids_sent;
+
 static struct idlist *add_to_list(struct idlist **root, int id, char *name,
 				  int id2)
 {
@@ -265,7 +271,7 @@ void add_gid(gid_t gid)
 }
 
 
-/* send a complete uid/gid mapping to the peer */
+/* send the uid/gid mapping (of any ids we haven't sent yet) to the peer */
 void send_uid_list(int f)
 {
 	struct idlist *list;
@@ -276,7 +282,7 @@ void send_uid_list(int f)
 	if (preserve_uid) {
 		int len;
 		/* we send sequences of uid/byte-length/name */
-		for (list = uidlist; list; list = list->next) {
+		for (list = uidlist; list != uids_sent; list = list->next) {
 			if (!list->name)
 				continue;
 			len = strlen(list->name);
@@ -288,11 +294,12 @@ void send_uid_list(int f)
 		/* terminate the uid list with a 0 uid. We explicitly exclude
 		 * 0 from the list */
 		write_int(f, 0);
+		uids_sent = uidlist;
 	}
 
 	if (preserve_gid) {
 		int len;
-		for (list = gidlist; list; list = list->next) {
+		for (list = gidlist; list != gids_sent; list = list->next) {
 			if (!list->name)
 				continue;
 			len = strlen(list->name);
@@ -301,12 +308,13 @@ void send_uid_list(int f)
 			write_buf(f, list->name, len);
 		}
 		write_int(f, 0);
+		gids_sent = gidlist;
 	}
 }
 
-/* recv a complete uid/gid mapping from the peer and map the uid/gid
- * in the file list to local names */
-void recv_uid_list(int f, struct file_list *flist)
+/* recv the uid/gid mapping from the peer and map the uid/gid of the file
+ * list's entries from start on to local names */
+void recv_uid_list(int f, struct file_list *flist, int start)
 {
 	int id, i;
 	char *name;
@@ -337,11 +345,11 @@ void recv_uid_list(int f, struct file_list *flist)
 
 	/* Now convert all the uids/gids from sender values to our values. */
 	if (am_root && preserve_uid && !numeric_ids) {
-		for (i = 0; i < flist->count; i++)
+		for (i = start; i < flist->count; i++)
 			flist->files[i]->uid = match_uid(flist->files[i]->uid);
 	}
 	if (preserve_gid && (!am_root || !numeric_ids)) {
-		for (i = 0; i < flist->count; i++)
+		for (i = start; i < flist->count; i++)
 			flist->files[i]->gid = match_gid(flist->files[i]->gid);
 	}
 }
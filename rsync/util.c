@@ -26,6 +26,7 @@
 extern int verbose;
 extern int dry_run;
 extern int module_id;
+extern int do_fsync;
 extern int modify_window;
 extern int relative_paths;
 extern int human_readable;
@@ -165,6 +166,61 @@ int set_modtime(char *fname, time_t modtime, mode_t mode)
 	}
 }
 
+/* Like set_modtime(), but for a regular file that we still have open. */
+int set_modtime_fd(int fd, char *fname, time_t modtime)
+{
+#ifdef HAVE_FUTIMES
+	struct timeval t[2];
+
+	if (verbose > 2) {
+		rprintf(FINFO, "set modtime of %s to (%ld) %s",
+			fname, (long)modtime,
+			asctime(localtime(&modtime)));
+	}
+
+	if (dry_run)
+		return 0;
+
+	t[0].tv_sec = time(NULL);
+	t[0].tv_usec = 0;
+	t[1].tv_sec = modtime;
+	t[1].tv_usec = 0;
+	return futimes(fd, t);
+#else
+	return set_modtime(fname, modtime, S_IFREG);
+#endif
+}
+
+#ifdef SUPPORT_ATTRS_AT
+/* Like set_modtime(), but for name relative to the open directory dfd
+ * (fname is the full name, for messages). */
+int set_modtime_at(int dfd, char *name, char *fname, time_t modtime,
+		   mode_t mode)
+{
+	struct timespec t[2];
+
+#ifndef HAVE_LUTIMES
+	if (S_ISLNK(mode))
+		return 1;
+#endif
+
+	if (verbose > 2) {
+		rprintf(FINFO, "set modtime of %s to (%ld) %s",
+			fname, (long)modtime,
+			asctime(localtime(&modtime)));
+	}
+
+	if (dry_run)
+		return 0;
+
+	t[0].tv_sec = time(NULL);
+	t[0].tv_nsec = 0;
+	t[1].tv_sec = modtime;
+	t[1].tv_nsec = 0;
+	return utimensat(dfd, name, t, S_ISLNK(mode) ? AT_SYMLINK_NOFOLLOW : 0);
+}
+#endif
+
 /* This creates a new directory with default permissions.  Since there
  * might be some directory-default permissions affecting this, we can't
  * force the permissions directly using the original umask and mkdir(). */
@@ -308,6 +364,13 @@ int copy_file(const char *source, const char *dest, mode_t mode)
 			full_fname(source));
 	}
 
+	if (do_fsync && fsync(ofd) < 0) {
+		rsyserr(FERROR, errno, "fsync failed on %s",
+			full_fname(dest));
+		close(ofd);
+		return -1;
+	}
+
 	if (close(ofd) < 0) {
 		rsyserr(FERROR, errno, "close failed on %s",
 			full_fname(dest));
@@ -888,6 +951,8 @@ int push_dir(char *dir, int set_path_only)
 	if (!set_path_only && chdir(dir))
 		return 0;
 
+	forget_attrs_dir();
+
 	if (*dir == '/') {
 		memcpy(curr_dir, dir, len + 1);
 		curr_dir_len = len;
@@ -916,6 +981,8 @@ int pop_dir(char *dir)
 	if (chdir(dir))
 		return 0;
 
+	forget_attrs_dir();
+
 	curr_dir_len = strlcpy(curr_dir, dir, sizeof curr_dir);
 	if (curr_dir_len >= sizeof curr_dir)
 		curr_dir_len = sizeof curr_dir - 1;